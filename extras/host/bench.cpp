@@ -0,0 +1,64 @@
+/* bench.cpp
+   Microbenchmarks of the read and receive paths on the host. Absolute
+   numbers say little about a microcontroller; compare them between
+   builds and commits.
+*/
+
+#include <stdio.h>
+#include <chrono>
+#include "NTP2.h"
+#include "sim.h"
+
+namespace {
+
+volatile uint64_t sink;
+
+template <typename F>
+void bench(const char* name, uint32_t iterations, F body) {
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) body(i);
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+  printf("%-28s %10.1f ns\n", name, ns);
+}
+
+}
+
+int main() {
+  sim::seed(1);
+  sim::SimUDP udp;
+  NTP2 ntp(udp);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  while (!ntp.ntpStat()) {
+    ntp.update();
+    sim::advanceMillis(1);
+  }
+
+  const uint32_t n = 10000000;
+  bench("epoch()", n, [&](uint32_t) { sink = ntp.epoch(); });
+  bench("epochMillis()", n, [&](uint32_t) { sink = ntp.epochMillis(); });
+  bench("epochMicros()", n, [&](uint32_t) { sink = ntp.epochMicros(); });
+  bench("ntpTime()", n, [&](uint32_t) { sink = ntp.ntpTime(); });
+  bench("millisToNextSecond()", n, [&](uint32_t) { sink = ntp.millisToNextSecond(); });
+#ifndef NTP2_NO_CALENDAR
+  NTPDateTime t;
+  bench("utc()", n, [&](uint32_t) { sink = ntp.utc(t); });
+#endif
+  bench("update(), idle", n, [&](uint32_t) { sink = ntp.update(); });
+
+  uint8_t reply[48] = {0x24, 2, 6, 0xEC};
+  reply[40] = 0xE9;
+  bench("classify()", n, [&](uint32_t i) {
+    reply[47] = (uint8_t)i;
+    sink = NTP2::classify(reply, sizeof(reply));
+  });
+
+  // A whole exchange over a link with no delay: request, reply, filter,
+  // clock update and snapshot
+  udp.link.delayUs = 0;
+  bench("forceUpdate() + reply", 200000, [&](uint32_t) {
+    ntp.forceUpdate();
+    while (ntp.update() == NTP_IDLE) sim::advance(100);
+  });
+  return 0;
+}
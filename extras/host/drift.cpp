@@ -0,0 +1,442 @@
+/* drift.cpp
+   Accuracy runs against simulated servers: each scenario drives NTP2
+   through hours or days of virtual time and checks the clock error and
+   the learned frequency. Exits non-zero if any scenario fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <functional>
+#include "NTP2.h"
+#include "sim.h"
+
+namespace {
+
+struct Result {
+  uint32_t syncs = 0;
+  int64_t maxErrUs = 0;          // worst |error| after settling
+  int64_t lastErrUs = 0;
+};
+
+int failures = 0;
+
+// Everything else a loop() would do besides ntp.update(): other clients,
+// a dispatcher, a broadcasting server. Returns how long it can sleep, ms.
+typedef std::function<uint32_t()> Others;
+
+// Run update() for trueMs of virtual time, sleeping as nextWakeMillis()
+// allows, and track the error from settleMs on. While a request is out
+// the socket is polled every 100 us, as a busy loop() would, so T4 isn't
+// taken late by the sleep.
+void run(NTP2& ntp, uint64_t trueMs, Result& r, uint64_t settleMs = 0, Others others = nullptr) {
+  uint64_t end = sim::trueMicros() + trueMs * 1000;
+  uint64_t settled = sim::trueMicros() + settleMs * 1000;
+  while (sim::trueMicros() < end) {
+    if (ntp.update() == NTP_CONNECTED) r.syncs++;
+    if (ntp.ntpStat()) {
+      int64_t err = sim::errorMicros(ntp.epochMicros());
+      r.lastErrUs = err;
+      if (err < 0) err = -err;
+      if (sim::trueMicros() >= settled && err > r.maxErrUs) r.maxErrUs = err;
+    }
+    uint32_t wait = ntp.nextWakeMillis();
+    if (others) {
+      uint32_t w = others();
+      if (w < wait) wait = w;
+    }
+    if (wait <= NTP_RX_POLL) sim::advance(100);
+    else sim::advanceMillis(wait > 1000 ? 1000 : wait);
+  }
+}
+
+void report(const char* name, const Result& r, int32_t freq, bool pass) {
+  printf("%-38s syncs %5u  max %8.3f ms  last %8.3f ms  freq %7d ppb  %s\n", name, (unsigned)r.syncs,
+         r.maxErrUs / 1000.0, r.lastErrUs / 1000.0, (int)freq, pass ? "PASS" : "FAIL");
+  if (!pass) failures++;
+}
+
+// A scenario for a feature this build leaves out
+[[maybe_unused]] void skip(const char* name, const char* flag) {
+  printf("%-38s SKIP (%s)\n", name, flag);
+}
+
+bool near(int64_t value, int64_t target, int64_t tolerance) {
+  return llabs(value - target) <= tolerance;
+}
+
+// A clean link: the error stays within the read resolution and the
+// frequency converges on the oscillator's
+void clean() {
+  sim::reset();
+  sim::seed(1);
+  sim::drift(20);
+  sim::SimUDP udp;
+  NTP2 ntp(udp);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  Result r;
+  run(ntp, 24ULL * 3600 * 1000, r, 6ULL * 3600 * 1000);
+  report("clean, 20 ppm, 24 h", r, ntp.frequency(), r.maxErrUs < 1000 && near(ntp.frequency(), -20000, 1000));
+}
+
+// A slower leg out than back shifts the offset by half the difference;
+// nothing on the client can see it
+void asymmetric() {
+  sim::reset();
+  sim::seed(2);
+  sim::SimUDP udp;
+  udp.link.asymUs = 4000;
+  NTP2 ntp(udp);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  Result r;
+  run(ntp, 3600ULL * 1000, r, 60ULL * 1000);
+  report("4 ms asymmetry, 1 h", r, ntp.frequency(), near(r.lastErrUs, 2000, 500));
+}
+
+// Jitter, loss, reordering and duplicates across a pool of three
+void lossy() {
+  sim::reset();
+  sim::seed(3);
+  sim::drift(-35);
+  sim::SimUDP udp;
+  udp.link.jitterUs = 20000;
+  udp.link.lossPct = 20;
+  udp.link.reorderPct = 10;
+  udp.link.dupPct = 10;
+  NTP2 ntp(udp);
+  ntp.addServer(IPAddress(10, 0, 0, 1));
+  ntp.addServer(IPAddress(10, 0, 0, 2));
+  ntp.addServer(IPAddress(10, 0, 0, 3));
+  ntp.begin();
+  Result r;
+  run(ntp, 24ULL * 3600 * 1000, r, 6ULL * 3600 * 1000);
+  // Without filter history a held-back reply is taken as it comes
+  int64_t bound = NTP_FILTER_SIZE > 1 ? 15000 : udp.link.reorderUs / 2 + udp.link.jitterUs;
+  report("jitter 20 ms, 20% loss, reorder, dup", r, ntp.frequency(),
+         r.maxErrUs < bound && near(ntp.frequency(), 35000, 5000));
+}
+
+// One server of three refuses; the other two keep the clock
+void kod() {
+#if defined(NTP2_NO_KOD) || NTP_MAX_SERVERS < 3
+  skip("DENY from one of three, 6 h", NTP_MAX_SERVERS < 3 ? "NTP_MAX_SERVERS" : "NTP2_NO_KOD");
+#else
+  sim::reset();
+  sim::seed(4);
+  sim::drift(10);
+  sim::SimUDP udp;
+  sim::Link deny;
+  deny.kod = "DENY";
+  udp.servers[(uint32_t)IPAddress(10, 0, 0, 2)] = deny;
+  NTP2 ntp(udp);
+  ntp.addServer(IPAddress(10, 0, 0, 1));
+  ntp.addServer(IPAddress(10, 0, 0, 2));
+  ntp.addServer(IPAddress(10, 0, 0, 3));
+  ntp.begin();
+  Result r;
+  run(ntp, 6ULL * 3600 * 1000, r, 3600ULL * 1000);
+  bool refused = ntp.syncServer() != 1 && ntp.serverKod(1) == NTP_KOD_DENY && ntp.serverScore(1) == 0xFFFF;
+  report("DENY from one of three, 6 h", r, ntp.frequency(), r.maxErrUs < 1000 && refused);
+#endif
+}
+
+// After the frequency is learned, a 6 h outage costs only what is left
+// of the frequency error
+void holdover() {
+  sim::reset();
+  sim::seed(5);
+  sim::drift(50);
+  sim::SimUDP udp;
+  NTP2 ntp(udp);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  Result learn;
+  run(ntp, 24ULL * 3600 * 1000, learn);
+  udp.link.lossPct = 100;
+  Result r;
+  run(ntp, 6ULL * 3600 * 1000, r);
+  report("6 h outage at 50 ppm", r, ntp.frequency(), r.maxErrUs < 25000);
+}
+
+// millis() wraps 3 hours in, once the frequency is learned; micros()
+// wraps every 71 minutes throughout
+void wrap() {
+  sim::reset(1760000000ULL * 1000000ULL, 0x100000000ULL * 1000ULL - 3ULL * 3600 * 1000000ULL);
+  sim::seed(6);
+  sim::drift(-15);
+  sim::SimUDP udp;
+  NTP2 ntp(udp);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  Result r;
+  run(ntp, 6ULL * 3600 * 1000, r, 2ULL * 3600 * 1000);
+  report("millis() wrap at 3 h, 6 h", r, ntp.frequency(), r.maxErrUs < 1000 && near(ntp.frequency(), 15000, 1000));
+}
+
+// Failover asks only the top-ranked server. With one-minute polls the
+// primary goes dark for long enough to miss all of its last eight, so the
+// fallback takes over; once it is back it has to be asked again and win
+// the job back, rather than sit unpolled on its old misses.
+void failover() {
+#if NTP_MAX_SERVERS < 3
+  skip("failover: primary out 30 min and back", "NTP_MAX_SERVERS");
+#else
+  sim::reset();
+  sim::seed(7);
+  sim::drift(25);
+  sim::SimUDP udp;
+  NTP2 ntp(udp);
+  ntp.addServer(IPAddress(10, 0, 0, 1));
+  ntp.addServer(IPAddress(10, 0, 0, 2));
+  ntp.addServer(IPAddress(10, 0, 0, 3));
+  ntp.failover(true);
+  ntp.updateInterval(60000);
+  ntp.begin();
+  Result warm;
+  run(ntp, 3600ULL * 1000, warm);
+  bool primary = ntp.syncServer() == 0;
+  sim::Link dark;
+  dark.lossPct = 100;
+  udp.servers[(uint32_t)IPAddress(10, 0, 0, 1)] = dark;
+  Result r;
+  run(ntp, 1800ULL * 1000, r);
+  bool fellBack = ntp.syncServer() == 1;
+  udp.servers.clear();
+  run(ntp, 3ULL * 3600 * 1000, r);
+  report("failover: primary out 30 min and back", r, ntp.frequency(),
+         r.maxErrUs < 1000 && primary && fellBack && ntp.syncServer() == 0);
+#endif
+}
+
+// A client synced to an NTP2 in server mode, which is synced to a
+// stratum-1 server; a second client sending every 100 ms gets one RATE
+// KoD and then nothing
+void server() {
+#ifdef NTP2_NO_SERVE
+  skip("server mode, 6 h", "NTP2_NO_SERVE");
+#else
+  sim::reset();
+  sim::seed(8);
+  sim::drift(-20);
+  sim::SimUDP up, lan, abuser;
+  up.link.stratum = 1;
+  lan.localIP = IPAddress(10, 0, 1, 2);
+  abuser.localIP = IPAddress(10, 0, 1, 9);
+  up.hosts[(uint32_t)lan.localIP] = &lan;
+  up.hosts[(uint32_t)abuser.localIP] = &abuser;
+  lan.hosts[(uint32_t)up.localIP] = &up;
+  lan.link.delayUs = 1000;
+  up.servers[(uint32_t)lan.localIP].delayUs = 1000;
+  NTP2 srv(up);
+  srv.serve(true);
+  srv.begin(IPAddress(10, 0, 0, 1));
+  NTP2 ntp(lan);
+  ntp.begin(up.localIP);
+  Result r;
+  run(ntp, 6ULL * 3600 * 1000, r, 3ULL * 3600 * 1000, [&]() {
+    srv.update();
+    return srv.nextWakeMillis();
+  });
+  bool stratum = lan.lastRead.size() >= 48 && (lan.lastRead[0] & 0x07) == 4 && lan.lastRead[1] == 2;
+
+  // The abuser's requests go straight onto the server's socket
+  uint8_t req[48] = {0x23};
+  uint32_t answers = 0, kods = 0;
+  for (int i = 0; i < 20; i++) {
+    req[47] = (uint8_t)i;
+    up.inject(req, sizeof(req), abuser.localIP, 50000, sim::trueMicros());
+    for (int t = 0; t < 100; t++) {
+      srv.update();
+      sim::advanceMillis(1);
+    }
+    while (abuser.parsePacket()) {
+      if (abuser.lastRead[1] == 0 && memcmp(&abuser.lastRead[12], "RATE", 4) == 0) kods++;
+      else answers++;
+    }
+  }
+  report("server mode, 6 h", r, ntp.frequency(), r.maxErrUs < 1000 && stratum && answers == 1 && kods == 1);
+#endif
+}
+
+// Mode-5 broadcasts every 64 s after one calibration request
+void listen() {
+#ifdef NTP2_NO_LISTEN
+  skip("listen, 64 s broadcasts, 12 h", "NTP2_NO_LISTEN");
+#else
+  sim::reset();
+  sim::seed(9);
+  sim::drift(15);
+  sim::SimUDP udp;
+  udp.link.jitterUs = 200;
+  NTP2 ntp(udp);
+  ntp.listen(true);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  uint64_t next = sim::trueMicros() + 5000000ULL;
+  Result r;
+  run(ntp, 12ULL * 3600 * 1000, r, 3ULL * 3600 * 1000, [&]() {
+    if (sim::trueMicros() >= next) {
+      sim::broadcast(udp, IPAddress(10, 0, 0, 1), udp.link);
+      next += 64000000ULL;
+    }
+    return (uint32_t)((next - sim::trueMicros()) / 1000);
+  });
+  report("listen, 64 s broadcasts, 12 h", r, ntp.frequency(),
+         r.maxErrUs < 1000 && r.syncs > 600 && udp.requests == 1 && near(ntp.frequency(), -15000, 1500));
+#endif
+}
+
+// Two clients on one dispatcher socket, each against its own server; their
+// own sockets stay unused. With the dispatcher gone they are back on them.
+void dispatcher() {
+  sim::reset();
+  sim::seed(10);
+  sim::drift(30);
+  sim::SimUDP shared, ownA, ownB;
+  shared.servers[(uint32_t)IPAddress(10, 0, 0, 2)].serverErrUs = 3000;
+  NTP2 a(ownA);
+  NTP2 b(ownB);
+  Result r;
+  bool bSynced;
+  {
+    NTP2Dispatcher d(shared);
+    bool ok = d.begin() >= NTP_EPHEMERAL_MIN && d.attach(a) && d.attach(b);
+    a.begin(IPAddress(10, 0, 0, 1));
+    b.begin(IPAddress(10, 0, 0, 2));
+    run(a, 6ULL * 3600 * 1000, r, 3600ULL * 1000, [&]() {
+      d.update();
+      b.update();
+      return b.nextWakeMillis();
+    });
+    // b's server is 3 ms ahead
+    bSynced = ok && near(sim::errorMicros(b.epochMicros()), 3000, 1000);
+  }
+  bool unused = ownA.sent == 0 && ownB.sent == 0 && shared.requests > 0;
+  a.begin(IPAddress(10, 0, 0, 1));
+  Result after;
+  run(a, 600ULL * 1000, after);
+  report("dispatcher, two clients, 6 h", r, a.frequency(),
+         r.maxErrUs < 1000 && bSynced && unused && ownA.replies > 0 && after.syncs > 0);
+}
+
+// Saves over 24 h of one-minute polls are rate-limited to about one an
+// hour; a reboot an hour later restores the clock and frequency before
+// the first reply comes in
+uint8_t savedBlob[NTP_STATE_SIZE];
+uint64_t savedAtUs = 0;
+uint32_t saves = 0;
+
+void saveBlob(const uint8_t* blob, size_t len) {
+  memcpy(savedBlob, blob, len);
+  savedAtUs = sim::trueMicros();
+  saves++;
+}
+
+bool loadBlob(uint8_t* blob, size_t len, uint32_t& elapsedMs) {
+  if (saves == 0) return false;
+  memcpy(blob, savedBlob, len);
+  elapsedMs = (uint32_t)((sim::trueMicros() - savedAtUs) / 1000);
+  return true;
+}
+
+void warmStart() {
+  sim::reset();
+  sim::seed(11);
+  sim::drift(40);
+  saves = 0;
+  sim::SimUDP udp;
+  Result r;
+  {
+    NTP2 ntp(udp);
+    ntp.updateInterval(60000);
+    ntp.persist(saveBlob, loadBlob);
+    ntp.begin(IPAddress(10, 0, 0, 1));
+    run(ntp, 24ULL * 3600 * 1000, r, 6ULL * 3600 * 1000);
+  }
+  bool limited = saves > 0 && saves <= 24 + 4 && r.syncs > 1000;
+
+  // Power off for an hour; the device's counters start from zero again
+  uint64_t off = sim::trueMicros() + 3600ULL * 1000000;
+  sim::reset(off, 1000000ULL);
+  sim::drift(40);
+  udp.link.lossPct = 100;
+  NTP2 ntp(udp);
+  ntp.persist(saveBlob, loadBlob);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  int64_t restoredUs = sim::errorMicros(ntp.epochMicros());
+  int32_t restoredFreq = ntp.frequency();
+  udp.link.lossPct = 0;
+  Result after;
+  run(ntp, 3600ULL * 1000, after);
+  r.lastErrUs = after.lastErrUs;
+  if (after.maxErrUs > r.maxErrUs) r.maxErrUs = after.maxErrUs;
+  report("warm start after 1 h off", r, restoredFreq,
+         limited && llabs(restoredUs) < 5000 && near(restoredFreq, -40000, 1000) && after.maxErrUs < 5000);
+}
+
+// Corrections under the threshold are slewed: a 50 ms shift of the
+// server is worked off without a step or the clock running backwards; a
+// 500 ms one steps once
+#ifndef NTP2_NO_SLEW
+int32_t steps = 0;
+int32_t lastStepMs = 0;
+
+void countStep(int32_t stepMs) {
+  steps++;
+  lastStepMs = stepMs;
+}
+#endif
+
+void slew() {
+#ifdef NTP2_NO_SLEW
+  skip("slew 50 ms, then step 500 ms", "NTP2_NO_SLEW");
+#else
+  sim::reset();
+  sim::seed(12);
+  sim::drift(-10);
+  steps = 0;
+  sim::SimUDP udp;
+  NTP2 ntp(udp);
+  ntp.slew(true, NTP_SLEW_THRESHOLD, NTP_SLEW_WINDOW, countStep);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  Result warm;
+  run(ntp, 6ULL * 3600 * 1000, warm);
+
+  uint64_t last = 0;
+  bool backwards = false;
+  auto monotonic = [&]() {
+    uint64_t now = ntp.epochMicros();
+    backwards |= now < last;
+    last = now;
+    return (uint32_t)1000;
+  };
+  // Checked one slew window after the sync that sees the shift, before
+  // the next poll; later ones also pull the frequency towards it
+  udp.link.serverErrUs = 50000;
+  Result r;
+  run(ntp, 10ULL * 60 * 1000, r, 0, monotonic);
+  bool slewed = r.syncs == 1 && steps == 0 && !backwards && near(r.lastErrUs, 50000, 3000);
+  int32_t freq = ntp.frequency();
+  udp.link.serverErrUs = 550000;
+  Result stepped;
+  run(ntp, 3600ULL * 1000, stepped);
+  // The step is the 500 ms less what the 50 ms shift pulled the frequency by
+  report("slew 50 ms, then step 500 ms", r, freq,
+         slewed && steps == 1 && near(lastStepMs, 500, 20));
+#endif
+}
+
+}
+
+int main() {
+  clean();
+  asymmetric();
+  lossy();
+  kod();
+  holdover();
+  wrap();
+  failover();
+  server();
+  listen();
+  dispatcher();
+  warmStart();
+  slew();
+  printf("%d failed\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+/* fuzz.cpp
+   Fuzz target for the receive path. Each input goes through classify()
+   and then, twice, through a client with a request in flight: once as
+   it is and once with the request's token stamped in, so that the
+   decoder, the clock filter and the clock update behind the match see
+   arbitrary packets too.
+
+   With clang's libFuzzer:  make fuzz && ./fuzz corpus/
+   Without it, NTP2_FUZZ_MAIN adds a main() that runs the target over
+   the files named on the command line, or over random mutations of a
+   valid reply when there are none:  make fuzz-host && ./fuzz-host
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "NTP2.h"
+#include "sim.h"
+
+namespace {
+
+void check(bool ok, const char* what) {
+  if (ok) return;
+  fprintf(stderr, "fuzz: %s\n", what);
+  abort();
+}
+
+void throughClient(const uint8_t* data, size_t size, bool stamp) {
+  sim::reset();
+  sim::SimUDP udp;
+  udp.link.lossPct = 100;
+  NTP2 ntp(udp);
+  ntp.begin(IPAddress(10, 0, 0, 1));
+  ntp.update();
+  NTPStatus st = sim::deliver(ntp, udp, data, size, stamp);
+  // A reply the receive path takes has to have passed the same checks
+  if (st == NTP_CONNECTED) check(NTP2::classify(data, size) == NTP_PKT_ACCEPT, "accepted a packet classify() rejects");
+  // Whatever came in, the getters and a later poll have to work
+  ntp.epochMicros();
+  ntp.millisToNextSecond();
+  sim::advanceMillis(2000);
+  ntp.update();
+}
+
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  NTPStatus kod = NTP_IDLE;
+  NTPVerdict v = NTP2::classify(data, size, &kod);
+  check(v <= NTP_PKT_BAD_STRATUM, "verdict out of range");
+  check((v == NTP_PKT_KOD) == (kod != NTP_IDLE), "KoD code without a KoD verdict");
+  check(size >= 48 || v == NTP_PKT_UNDERSIZED, "short packet not undersized");
+  throughClient(data, size, false);
+  throughClient(data, size, true);
+  return 0;
+}
+
+#ifdef NTP2_FUZZ_MAIN
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      FILE* f = fopen(argv[i], "rb");
+      if (!f) {
+        perror(argv[i]);
+        return 1;
+      }
+      std::vector<uint8_t> buf;
+      int c;
+      while ((c = fgetc(f)) != EOF) buf.push_back((uint8_t)c);
+      fclose(f);
+      LLVMFuzzerTestOneInput(buf.data(), buf.size());
+    }
+    printf("%d inputs ok\n", argc - 1);
+    return 0;
+  }
+
+  // Random mutations of a valid reply: a few bytes flipped, and a random
+  // length around the header size
+  const uint32_t runs = 200000;
+  uint8_t base[68] = {0x24, 2, 6, 0xEC};
+  base[12] = 'S';
+  base[32] = base[40] = 0xE9;
+  sim::seed(0xF022);
+  for (uint32_t i = 0; i < runs; i++) {
+    uint8_t buf[68];
+    memcpy(buf, base, sizeof(buf));
+    uint32_t flips = 1 + sim::randomBelow(8);
+    for (uint32_t k = 0; k < flips; k++) buf[sim::randomBelow(sizeof(buf))] = (uint8_t)sim::random32();
+    LLVMFuzzerTestOneInput(buf, 40 + sim::randomBelow(sizeof(buf) - 39));
+  }
+  printf("%u mutations ok\n", (unsigned)runs);
+  return 0;
+}
+#endif
@@ -0,0 +1,250 @@
+/* replay.cpp
+   Replays captured NTP packets through classify() and, with -s, through
+   a client's receive path, then prints the verdict tallies and packets
+   per second.
+
+     ./replay capture.pcap        libpcap capture; UDP port 123 payloads
+     ./replay packets.hex         one packet per line in hex; '#' comments
+     ./replay -s capture.pcap     also feed each one to a client as the
+                                  reply to its request, token stamped in
+
+   pcap files may be Ethernet (with 802.1Q tags), Linux cooked (v1, v2),
+   BSD loopback or raw IP, over IPv4 or IPv6, in either byte order.
+   pcapng isn't read; convert it with editcap -F pcap first. With -s the
+   client has the one server, so after a DENY or RSTR it is demoted and
+   later replies go unanswered, as they would on a device.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "NTP2.h"
+#include "sim.h"
+
+namespace {
+
+typedef std::vector<uint8_t> Bytes;
+
+const char* verdictName(uint8_t v) {
+  static const char* const names[] = {"accept", "request", "kod", "undersized", "bad time",
+                                      "bad leap", "bad version", "bad mode", "bad stratum"};
+  return v < sizeof(names) / sizeof(names[0]) ? names[v] : "?";
+}
+
+const char* statusName(NTPStatus st) {
+  static const char* const kods[] = {"kod RATE", "kod DENY", "kod ACST", "kod AUTH", "kod AUTO",
+                                     "kod BCST", "kod CRYP", "kod DROP", "kod RSTR", "kod INIT",
+                                     "kod MCST", "kod NKEY", "kod NTSN", "kod RMOT", "kod STEP"};
+  switch (st) {
+    case NTP_BAD_PACKET: return "bad packet";
+    case NTP_IDLE: return "idle (not taken)";
+    case NTP_CONNECTED: return "connected";
+    case NTP_UNKNOWN_KOD: return "kod (unknown)";
+    default: return st >= NTP_KOD_RATE && st <= NTP_KOD_STEP ? kods[st - NTP_KOD_RATE] : "?";
+  }
+}
+
+uint16_t get16(const uint8_t* p, bool big) {
+  return big ? (uint16_t)(p[0] << 8 | p[1]) : (uint16_t)(p[1] << 8 | p[0]);
+}
+
+uint32_t get32(const uint8_t* p, bool big) {
+  return big ? (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]
+             : (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+// The NTP payload of an IPv4 or IPv6 datagram, if it is UDP to or from
+// port 123 and not a fragment past the first
+bool ntpPayload(const uint8_t* p, size_t len, Bytes& out) {
+  if (len < 1) return false;
+  size_t udp;
+  if ((p[0] >> 4) == 4) {
+    size_t ihl = (p[0] & 0x0F) * 4;
+    if (len < ihl + 8 || ihl < 20 || p[9] != 17) return false;
+    if (get16(&p[6], true) & 0x1FFF) return false;
+    udp = ihl;
+  } else if ((p[0] >> 4) == 6) {
+    if (len < 48 || p[6] != 17) return false;
+    udp = 40;
+  } else {
+    return false;
+  }
+  uint16_t src = get16(&p[udp], true);
+  uint16_t dst = get16(&p[udp + 2], true);
+  if (src != 123 && dst != 123) return false;
+  size_t ulen = get16(&p[udp + 4], true);
+  if (ulen < 8 || udp + ulen > len) ulen = len - udp;
+  out.assign(p + udp + 8, p + udp + ulen);
+  return true;
+}
+
+bool readPcap(FILE* f, std::vector<Bytes>& packets) {
+  uint8_t hdr[24];
+  if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) return false;
+  uint32_t magic = get32(hdr, true);
+  bool big;
+  if (magic == 0xA1B2C3D4 || magic == 0xA1B23C4D) big = true;
+  else if (magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1) big = false;
+  else return false;
+  uint32_t link = get32(&hdr[20], big) & 0xFFFF;
+
+  uint8_t rec[16];
+  Bytes frame;
+  while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+    uint32_t caplen = get32(&rec[8], big);
+    if (caplen > 262144) break;
+    frame.resize(caplen);
+    if (fread(frame.data(), 1, caplen, f) != caplen) break;
+    const uint8_t* p = frame.data();
+    size_t n = caplen;
+    size_t skip;
+    switch (link) {
+      case 1: {  // Ethernet
+        skip = 14;
+        size_t type = 12;
+        while (n >= type + 2 && (get16(&p[type], true) == 0x8100 || get16(&p[type], true) == 0x88A8)) {
+          type += 4;
+          skip += 4;
+        }
+        break;
+      }
+      case 0:    // BSD loopback
+        skip = 4;
+        break;
+      case 113:  // Linux cooked
+        skip = 16;
+        break;
+      case 276:  // Linux cooked v2
+        skip = 20;
+        break;
+      case 12:
+      case 101:  // raw IP
+        skip = 0;
+        break;
+      default:
+        fprintf(stderr, "replay: link type %u not supported\n", (unsigned)link);
+        return true;
+    }
+    Bytes payload;
+    if (n > skip && ntpPayload(p + skip, n - skip, payload)) packets.push_back(payload);
+  }
+  return true;
+}
+
+void readHex(FILE* f, std::vector<Bytes>& packets) {
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    Bytes pkt;
+    int nibble = -1;
+    for (char* c = line; *c && *c != '#'; c++) {
+      int v;
+      if (*c >= '0' && *c <= '9') v = *c - '0';
+      else if (*c >= 'a' && *c <= 'f') v = *c - 'a' + 10;
+      else if (*c >= 'A' && *c <= 'F') v = *c - 'A' + 10;
+      else continue;
+      if (nibble < 0) {
+        nibble = v;
+      } else {
+        pkt.push_back((uint8_t)(nibble << 4 | v));
+        nibble = -1;
+      }
+    }
+    if (!pkt.empty()) packets.push_back(pkt);
+  }
+}
+
+template <typename F>
+double perSecond(size_t count, F pass) {
+  // Repeat the whole set for at least 200 ms of wall time
+  auto start = std::chrono::steady_clock::now();
+  size_t done = 0;
+  double elapsed;
+  do {
+    pass();
+    done += count;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  } while (elapsed < 0.2);
+  return done / elapsed;
+}
+
+}
+
+int main(int argc, char** argv) {
+  bool stack = false;
+  std::vector<Bytes> packets;
+  int files = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      stack = true;
+      continue;
+    }
+    FILE* f = fopen(argv[i], "rb");
+    if (!f) {
+      perror(argv[i]);
+      return 1;
+    }
+    if (!readPcap(f, packets)) {
+      rewind(f);
+      readHex(f, packets);
+    }
+    fclose(f);
+    files++;
+  }
+  if (files == 0) {
+    fprintf(stderr, "usage: %s [-s] capture.pcap|packets.hex...\n", argv[0]);
+    return 2;
+  }
+  if (packets.empty()) {
+    printf("no NTP packets\n");
+    return 0;
+  }
+
+  uint32_t verdicts[NTP_PKT_BAD_STRATUM + 1] = {};
+  uint32_t kods[NTP_UNKNOWN_KOD + 1] = {};
+  for (const Bytes& p : packets) {
+    NTPStatus kod = NTP_IDLE;
+    NTPVerdict v = NTP2::classify(p.data(), p.size(), &kod);
+    verdicts[v]++;
+    if (v == NTP_PKT_KOD && kod <= NTP_UNKNOWN_KOD) kods[kod]++;
+  }
+  printf("%zu packets\n", packets.size());
+  for (uint8_t v = 0; v <= NTP_PKT_BAD_STRATUM; v++) {
+    if (verdicts[v]) printf("  %-12s %8u\n", verdictName(v), (unsigned)verdicts[v]);
+  }
+  for (uint16_t k = NTP_KOD_RATE; k <= NTP_UNKNOWN_KOD; k++) {
+    if (kods[k]) printf("  %-12s %8u\n", statusName((NTPStatus)k), (unsigned)kods[k]);
+  }
+
+  volatile uint8_t sink = 0;
+  double rate = perSecond(packets.size(), [&]() {
+    for (const Bytes& p : packets) sink = NTP2::classify(p.data(), p.size());
+  });
+  printf("classify(): %.0f packets/s\n", rate);
+
+  if (stack) {
+    // Server replies only; requests and broadcasts aren't answers to ours
+    std::vector<const Bytes*> replies;
+    for (const Bytes& p : packets) {
+      if (p.size() >= 1 && (p[0] & 0x07) == 4) replies.push_back(&p);
+    }
+    sim::SimUDP udp;
+    udp.link.lossPct = 100;
+    NTP2 ntp(udp);
+    ntp.begin(IPAddress(10, 0, 0, 1));
+    uint32_t results[256] = {};
+    for (const Bytes* p : replies) results[sim::deliver(ntp, udp, p->data(), p->size(), true)]++;
+    printf("%zu replies through the client\n", replies.size());
+    for (int st = 0; st < 256; st++) {
+      if (results[st]) printf("  %-18s %8u\n", statusName((NTPStatus)st), (unsigned)results[st]);
+    }
+    if (!replies.empty()) {
+      rate = perSecond(replies.size(), [&]() {
+        for (const Bytes* p : replies) sink = sim::deliver(ntp, udp, p->data(), p->size(), true);
+      });
+      printf("receive path: %.0f replies/s\n", rate);
+    }
+  }
+  (void)sink;
+  return 0;
+}
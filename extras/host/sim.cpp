@@ -0,0 +1,281 @@
+/* sim.cpp
+   Virtual clock and simulated NTP servers for the host builds
+*/
+
+#include "sim.h"
+
+namespace {
+
+uint64_t trueNowUs = 1760000000ULL * 1000000ULL;
+uint64_t trueBaseUs = trueNowUs;
+uint64_t localBaseUs = 1000000ULL;
+uint64_t localNowUs = localBaseUs;
+double rate = 1.0;
+uint32_t rng = 0x2545F491UL;
+
+void put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+void put64(uint8_t* p, uint64_t v) {
+  put32(p, (uint32_t)(v >> 32));
+  put32(p + 4, (uint32_t)v);
+}
+
+}
+
+uint32_t millis() {
+  return (uint32_t)(localNowUs / 1000);
+}
+
+uint32_t micros() {
+  return (uint32_t)localNowUs;
+}
+
+void yield() {
+  sim::advance(1000);
+}
+
+namespace sim {
+
+void reset(uint64_t trueUnixUs, uint64_t localUs) {
+  trueNowUs = trueBaseUs = trueUnixUs;
+  localNowUs = localBaseUs = localUs;
+  rate = 1.0;
+}
+
+void drift(double ppm) {
+  // Re-base so the new rate applies from now on
+  trueBaseUs = trueNowUs;
+  localBaseUs = localNowUs;
+  rate = 1.0 + ppm / 1e6;
+}
+
+void advance(uint64_t trueUs) {
+  trueNowUs += trueUs;
+  localNowUs = localBaseUs + (uint64_t)((double)(trueNowUs - trueBaseUs) * rate);
+}
+
+void advanceMillis(uint64_t trueMs) {
+  advance(trueMs * 1000);
+}
+
+uint64_t trueMicros() {
+  return trueNowUs;
+}
+
+uint64_t localMicros() {
+  return localNowUs;
+}
+
+void seed(uint32_t s) {
+  rng = s ? s : 0x2545F491UL;
+}
+
+uint32_t random32() {
+  // xorshift32
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+uint32_t randomBelow(uint32_t n) {
+  return n ? (uint32_t)(((uint64_t)random32() * n) >> 32) : 0;
+}
+
+uint64_t toNtp(uint64_t unixUs) {
+  uint64_t sec = unixUs / 1000000 + SIM_NTP_UNIX_DELTA;
+  uint64_t frac = ((unixUs % 1000000) << 32) / 1000000;
+  return (sec << 32) | frac;
+}
+
+uint64_t fromNtp(uint64_t ntp) {
+  uint64_t sec = (ntp >> 32) - SIM_NTP_UNIX_DELTA;
+  return sec * 1000000 + (((ntp & 0xFFFFFFFFULL) * 1000000) >> 32);
+}
+
+int64_t errorMicros(uint64_t epochMicros) {
+  return (int64_t)(epochMicros - trueNowUs);
+}
+
+NTPStatus deliver(NTP2& ntp, SimUDP& udp, const uint8_t* data, size_t len, bool stamp) {
+  ntp.forceUpdate();  // a no-op while a request is already out
+  std::vector<uint8_t> pkt(data, data + len);
+  if (stamp && len >= 32) memcpy(&pkt[24], &udp.lastRequest[40], 8);
+  udp.inject(pkt.data(), pkt.size(), udp.lastRequestIP, 123, trueNowUs);
+  return ntp.update();
+}
+
+void broadcast(SimUDP& udp, IPAddress from, const Link& link) {
+  uint64_t tx = toNtp(trueNowUs + link.serverErrUs);
+  uint8_t b[48] = {};
+  b[0] = 0x25;  // LI 0, VN 4, broadcast
+  b[1] = link.stratum;
+  b[2] = 6;
+  b[3] = 0xEC;
+  put32(&b[4], 0x00000080);
+  put32(&b[8], 0x00000040);
+  memcpy(&b[12], "SIM", 4);
+  put64(&b[16], tx - (16ULL << 32));
+  put64(&b[40], tx);
+  udp.inject(b, sizeof(b), from, 123, trueNowUs + link.delayUs + randomBelow(link.jitterUs + 1));
+}
+
+uint8_t SimUDP::begin(uint16_t port) {
+  localPort = port;
+  return 1;
+}
+
+void SimUDP::stop() {
+  queue.clear();
+}
+
+int SimUDP::beginPacket(IPAddress ip, uint16_t port) {
+  out.clear();
+  outIP = ip;
+  outPort = port;
+  return 1;
+}
+
+int SimUDP::beginPacket(const char*, uint16_t port) {
+  return beginPacket(hostIP, port);
+}
+
+size_t SimUDP::write(uint8_t b) {
+  out.push_back(b);
+  return 1;
+}
+
+size_t SimUDP::write(const uint8_t* buffer, size_t size) {
+  out.insert(out.end(), buffer, buffer + size);
+  return size;
+}
+
+Link& SimUDP::linkFor(IPAddress ip) {
+  auto it = servers.find((uint32_t)ip);
+  return it == servers.end() ? link : it->second;
+}
+
+int SimUDP::endPacket() {
+  sent++;
+  bool request = out.size() >= 48 && (out[0] & 0x07) == 3;
+  if (request) {
+    requests++;
+    memcpy(lastRequest, out.data(), sizeof(lastRequest));
+    lastRequestIP = outIP;
+  }
+  Link& l = linkFor(outIP);
+  auto host = hosts.find((uint32_t)outIP);
+  if (host != hosts.end()) {
+    if (randomBelow(100) < l.lossPct) {
+      lost++;
+      return 1;
+    }
+    host->second->inject(out.data(), out.size(), localIP, localPort,
+                         trueNowUs + l.delayUs + randomBelow(l.jitterUs + 1));
+    return 1;
+  }
+
+  // Only client requests get an answer; anything else goes nowhere
+  if (!request) return 1;
+  if (randomBelow(100) < l.lossPct) {
+    lost++;
+    return 1;
+  }
+
+  uint64_t arrive = trueNowUs + l.delayUs + l.asymUs + randomBelow(l.jitterUs + 1);
+  uint64_t depart = arrive + 50;
+  uint8_t r[48] = {};
+  if (l.kod) {
+    r[0] = 0xE4;  // LI 3, VN 4, server
+    memcpy(&r[12], l.kod, 4);
+  } else {
+    uint64_t rx = toNtp(arrive + l.serverErrUs);
+    uint64_t tx = toNtp(depart + l.serverErrUs);
+    r[0] = 0x24;  // LI 0, VN 4, server
+    r[1] = l.stratum;
+    r[2] = 6;
+    r[3] = 0xEC;  // 2^-20 s
+    put32(&r[4], 0x00000080);    // root delay ~2 ms
+    put32(&r[8], 0x00000040);    // root dispersion ~1 ms
+    memcpy(&r[12], "SIM", 4);
+    put64(&r[16], tx - (16ULL << 32));
+    put64(&r[32], rx);
+    put64(&r[40], tx);
+  }
+  memcpy(&r[24], &out[40], 8);   // the request's token
+
+  if (randomBelow(100) < l.lossPct) {
+    lost++;
+    return 1;
+  }
+  uint64_t back = depart + l.delayUs + randomBelow(l.jitterUs + 1);
+  if (randomBelow(100) < l.reorderPct) {
+    reordered++;
+    back += l.reorderUs;
+  }
+  inject(r, sizeof(r), outIP, outPort, back);
+  replies++;
+  if (randomBelow(100) < l.dupPct) {
+    duplicated++;
+    inject(r, sizeof(r), outIP, outPort, back + 1000);
+  }
+  return 1;
+}
+
+void SimUDP::inject(const uint8_t* data, size_t len, IPAddress ip, uint16_t port, uint64_t atUs) {
+  Datagram d;
+  d.data.assign(data, data + len);
+  d.ip = ip;
+  d.port = port;
+  queue.emplace(atUs, d);
+}
+
+int SimUDP::parsePacket() {
+  if (queue.empty() || queue.begin()->first > trueNowUs) return 0;
+  current = queue.begin()->second;
+  queue.erase(queue.begin());
+  lastRead = current.data;
+  readPos = 0;
+  return (int)current.data.size();
+}
+
+int SimUDP::available() {
+  return (int)(current.data.size() - readPos);
+}
+
+int SimUDP::read() {
+  return readPos < current.data.size() ? current.data[readPos++] : -1;
+}
+
+int SimUDP::read(unsigned char* buffer, size_t len) {
+  size_t n = 0;
+  while (n < len && readPos < current.data.size()) buffer[n++] = current.data[readPos++];
+  return (int)n;
+}
+
+int SimUDP::read(char* buffer, size_t len) {
+  return read((unsigned char*)buffer, len);
+}
+
+int SimUDP::peek() {
+  return readPos < current.data.size() ? current.data[readPos] : -1;
+}
+
+void SimUDP::flush() {
+  readPos = current.data.size();
+}
+
+IPAddress SimUDP::remoteIP() {
+  return current.ip;
+}
+
+uint16_t SimUDP::remotePort() {
+  return current.port;
+}
+
+}
@@ -0,0 +1,132 @@
+/* sim.h
+   Off-device test bench for NTP2: a virtual clock with a drifting
+   oscillator, and a UDP socket whose far end is a simulated NTP server
+   behind a link with latency, jitter, asymmetry, loss, reordering,
+   duplicates and KoD.
+*/
+
+#ifndef NTP2_HOST_SIM_H
+#define NTP2_HOST_SIM_H
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include "NTP2.h"
+
+// NTP era 0 starts 70 years before the Unix epoch
+#define SIM_NTP_UNIX_DELTA 2208988800ULL
+
+namespace sim {
+
+// The virtual clock. True time is what the servers keep; the device's
+// millis()/micros() count it at (1 + ppm / 1e6) of the true rate, so a
+// positive ppm is a fast oscillator and NTP2 should learn a frequency()
+// of about -ppm * 1000.
+void reset(uint64_t trueUnixUs = 1760000000ULL * 1000000ULL, uint64_t localUs = 1000000ULL);
+void drift(double ppm);
+void advance(uint64_t trueUs);
+void advanceMillis(uint64_t trueMs);
+uint64_t trueMicros();
+uint64_t localMicros();
+
+// Deterministic generator for the link, so every run is repeatable
+void seed(uint32_t s);
+uint32_t random32();
+uint32_t randomBelow(uint32_t n);
+
+// One server and the path to it
+struct Link {
+  uint32_t delayUs = 10000;      // one way, each direction
+  uint32_t jitterUs = 0;         // uniform extra per direction
+  uint32_t asymUs = 0;           // extra on the outbound leg only
+  uint8_t lossPct = 0;           // per direction
+  uint8_t dupPct = 0;            // reply delivered twice, 1 ms apart
+  uint8_t reorderPct = 0;        // reply held back by reorderUs
+  uint32_t reorderUs = 100000;
+  int32_t serverErrUs = 0;       // server clock minus true time
+  uint8_t stratum = 2;
+  const char* kod = nullptr;     // 4-character code sent instead of time
+};
+
+// A UDP socket whose requests are answered by simulated servers. Every
+// address uses `link` unless it has an entry in `servers`; hostnames
+// resolve to `hostIP`. An address in `hosts` is another socket instead,
+// such as one an NTP2 serves on: whatever is sent to it arrives there
+// over the link, from this socket's localIP and the port it was opened on.
+class SimUDP : public UDP {
+  public:
+    Link link;
+    std::map<uint32_t, Link> servers;
+    IPAddress hostIP = IPAddress(10, 0, 0, 1);
+    std::map<uint32_t, SimUDP*> hosts;
+    IPAddress localIP = IPAddress(10, 0, 1, 1);
+    uint16_t localPort = 0;
+
+    // What happened on the wire
+    uint32_t requests = 0;
+    uint32_t replies = 0;
+    uint32_t lost = 0;
+    uint32_t duplicated = 0;
+    uint32_t reordered = 0;
+    uint8_t lastRequest[48] = {};  // for stamping a reply's Originate Timestamp
+    IPAddress lastRequestIP;
+    uint32_t sent = 0;             // every datagram, requests or not
+    std::vector<uint8_t> lastRead; // the datagram parsePacket() last took
+
+    uint8_t begin(uint16_t port) override;
+    void stop() override;
+    int beginPacket(IPAddress ip, uint16_t port) override;
+    int beginPacket(const char* host, uint16_t port) override;
+    int endPacket() override;
+    size_t write(uint8_t b) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    int parsePacket() override;
+    int available() override;
+    int read() override;
+    int read(unsigned char* buffer, size_t len) override;
+    int read(char* buffer, size_t len) override;
+    int peek() override;
+    void flush() override;
+    IPAddress remoteIP() override;
+    uint16_t remotePort() override;
+
+    // Queue a datagram as if it had arrived from ip:port at true time atUs
+    void inject(const uint8_t* data, size_t len, IPAddress ip, uint16_t port, uint64_t atUs);
+
+  private:
+    struct Datagram {
+      std::vector<uint8_t> data;
+      IPAddress ip;
+      uint16_t port;
+    };
+    Link& linkFor(IPAddress ip);
+
+    std::multimap<uint64_t, Datagram> queue;  // by arrival, true us
+    std::vector<uint8_t> out;
+    IPAddress outIP;
+    uint16_t outPort = 0;
+    Datagram current;
+    size_t readPos = 0;
+};
+
+// 32.32 NTP time from true Unix microseconds, and back
+uint64_t toNtp(uint64_t unixUs);
+uint64_t fromNtp(uint64_t ntp);
+
+// Device error against true time, from epochMicros()
+int64_t errorMicros(uint64_t epochMicros);
+
+// Hand one datagram to ntp as the answer to its request in flight,
+// sending one first if none is out, and return what update() makes of
+// it. Set udp.link.lossPct to 100 so the simulated server stays quiet.
+// With stamp, the request's token is written into the Originate
+// Timestamp so the reply correlates.
+NTPStatus deliver(NTP2& ntp, SimUDP& udp, const uint8_t* data, size_t len, bool stamp);
+
+// Queue a mode-5 broadcast on udp, sent now by the server at from and
+// arriving after the link's delay
+void broadcast(SimUDP& udp, IPAddress from, const Link& link);
+
+}
+
+#endif
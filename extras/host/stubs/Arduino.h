@@ -0,0 +1,50 @@
+/* Arduino.h
+   Host stand-in for the Arduino core, just what NTP2 uses. millis() and
+   micros() read the virtual clock in sim.h; yield() moves it on by 1 ms
+   so that blocking helpers such as syncOnce() make progress.
+*/
+
+#ifndef NTP2_HOST_ARDUINO_H
+#define NTP2_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t byte;
+
+uint32_t millis();
+uint32_t micros();
+void yield();
+
+#define LOW    0
+#define HIGH   1
+#define INPUT  0
+#define OUTPUT 1
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+
+#include "IPAddress.h"
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+      size_t n = 0;
+      while (size--) n += write(*buffer++);
+      return n;
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+};
+
+#endif
@@ -0,0 +1,37 @@
+/* IPAddress.h
+   Host stand-in for the core's IPv4 address: four octets, convertible
+   to and from the uint32_t lwIP and the library use.
+*/
+
+#ifndef NTP2_HOST_IPADDRESS_H
+#define NTP2_HOST_IPADDRESS_H
+
+#include <stdint.h>
+#include <string.h>
+
+class IPAddress {
+  public:
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+      octets[0] = a;
+      octets[1] = b;
+      octets[2] = c;
+      octets[3] = d;
+    }
+    IPAddress(uint32_t address) { memcpy(octets, &address, 4); }
+
+    operator uint32_t() const {
+      uint32_t v;
+      memcpy(&v, octets, 4);
+      return v;
+    }
+    uint8_t operator[](int index) const { return octets[index]; }
+    uint8_t& operator[](int index) { return octets[index]; }
+    bool operator==(const IPAddress& other) const { return memcmp(octets, other.octets, 4) == 0; }
+    bool operator!=(const IPAddress& other) const { return !(*this == other); }
+
+  private:
+    uint8_t octets[4] = {0, 0, 0, 0};
+};
+
+#endif
@@ -7,42 +7,306 @@
 
 #include "NTP2.h"
 
+#ifdef NTP2_LWIP_DNS
+#include "lwip/dns.h"
+#include "lwip/tcpip.h"
+#endif
+
+#ifdef NTP2_LWIP_UDP
+#include "lwip/udp.h"
+#include "lwip/pbuf.h"
+#include "lwip/igmp.h"
+#include "lwip/tcpip.h"
+#endif
+
+#ifdef NTP2_PPS
+#include "esp_timer.h"
+#endif
+
+#if defined(ESP32)
+#if __has_include(<esp_random.h>)
+#include "esp_random.h"
+#else
+#include "esp_system.h"
+#endif
+#endif
+
+#ifdef NTP2_TASK
+#if defined(ESP32)
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <FreeRTOS.h>
+#include <task.h>
+#endif
+
+// Requests posted to the background task by forceUpdate()
+#define NTP2_TASK_FORCE 0x01
+#define NTP2_TASK_BURST 0x02
+#endif
+
+// Orders the snapshot stores and loads against the sequence counter. A
+// compiler barrier is enough on single-core AVR; elsewhere it must also be
+// a hardware fence for readers on another core.
+#if defined(__AVR__)
+#define NTP2_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define NTP2_BARRIER() __sync_synchronize()
+#endif
+
+// Statistics counters compile away with NTP2_NO_STATS
+#ifdef NTP2_STATS
+#define NTP2_COUNT(field) (st.field++)
+#else
+#define NTP2_COUNT(field) ((void)0)
+#endif
+
+// Raw lwIP calls made from outside the lwIP thread go through
+// ntp2LwipCall(). A threaded stack with core locking (ESP32 core 3.x)
+// takes the lock. One without it (ESP32 core 2.x) has the call run on the
+// tcpip thread, as AsyncUDP does. arduino-pico's cyw43 stack has its own
+// arch lock, and a NO_SYS stack without one (ESP8266) already runs
+// everything in one context.
+#ifdef NTP2_LWIP_DNS
+#if !NO_SYS && !LWIP_TCPIP_CORE_LOCKING
+#include "lwip/priv/tcpip_priv.h"
+
+struct NTP2LwipCall {
+  struct tcpip_api_call_data base;  // must come first
+  void (*fn)(void*);
+  void* arg;
+};
+
+static err_t ntp2LwipRun(struct tcpip_api_call_data* data) {
+  NTP2LwipCall* call = (NTP2LwipCall*)data;
+  call->fn(call->arg);
+  return ERR_OK;
+}
+#elif NO_SYS && defined(ARDUINO_ARCH_RP2040) && __has_include(<pico/cyw43_arch.h>)
+#include <pico/cyw43_arch.h>
+#define NTP2_CYW43_LOCK
+#endif
+
+static void ntp2LwipCall(void (*fn)(void*), void* arg) {
+#if !NO_SYS && LWIP_TCPIP_CORE_LOCKING
+  LOCK_TCPIP_CORE();
+  fn(arg);
+  UNLOCK_TCPIP_CORE();
+#elif !NO_SYS
+  NTP2LwipCall call;
+  call.fn = fn;
+  call.arg = arg;
+  tcpip_api_call(ntp2LwipRun, &call.base);
+#elif defined(NTP2_CYW43_LOCK)
+  cyw43_arch_lwip_begin();
+  fn(arg);
+  cyw43_arch_lwip_end();
+#else
+  fn(arg);
+#endif
+}
+#endif
+
+// Every request is this header followed by its 8-byte Transmit Timestamp
+// token. LI=0, VN=4, Mode=3 (client); the rest is zero.
+static const uint8_t ntp2RequestHeader[NTP_PACKET_SIZE - 8] = {0b00100011};
+
 NTP2::NTP2(UDP& udp) {
   this->udp = &udp;
 }
 
+NTP2Dispatcher::~NTP2Dispatcher() {
+  // Clients outliving us go back to their own sockets rather than
+  // keeping a pointer to us
+  while (clientCount) detach(*clients[0]);
+}
+
+#ifdef NTP2_LWIP_UDP
+NTP2::NTP2() {
+  // lwIP raw-API backend, see rawRecv()
+  this->udp = nullptr;
+}
+#endif
+
 NTP2::~NTP2() {
   stop();
+  if (dispatcher) dispatcher->detach(*this);
 }
 
 void NTP2::begin() {
-  begin(NTP_SERVER);
-  lastUpdate = millis() - activeInterval;
+  // Servers registered with addServer() beforehand take precedence
+  if (peerCount == 0) addServer(NTP_SERVER);
+  start();
 }
 
 void NTP2::begin(const char* server) {
-  this->server = server ? server : NTP_SERVER;
-  udp->begin(NTP_PORT);
-  force = true;
-  lastUpdate = millis() - activeInterval;
+  endCycle();
+  clearServers();
+  addServer(server ? server : NTP_SERVER);
+  start();
 }
 
 void NTP2::begin(IPAddress serverIP) {
-  this->serverIP = serverIP;
-  this->server = nullptr;
-  udp->begin(NTP_PORT);
-  force = true;
-  lastUpdate = millis() - activeInterval;
+  endCycle();
+  clearServers();
+  addServer(serverIP);
+  start();
+}
+
+void NTP2::start() {
+  // Warm start: a provisional clock and the learned rate and interval
+  if (stateLoadFn && ntpTimeSeconds == 0) {
+    uint8_t blob[NTP_STATE_SIZE];
+    uint32_t elapsedMs = 0;
+    if (stateLoadFn(blob, sizeof(blob), elapsedMs)) restoreState(blob, sizeof(blob), elapsedMs);
+  }
+
+#ifdef NTP2_LWIP_UDP
+  if (!udp) {
+    if (!pcb) {
+      ntp2LwipCall([](void* arg) {
+        NTP2* self = static_cast<NTP2*>(arg);
+        self->pcb = udp_new();
+        if (!self->pcb) return;
+        udp_bind(self->pcb, IP_ADDR_ANY, NTP_PORT);
+        udp_recv(self->pcb, [](void* arg, struct udp_pcb*, struct pbuf* p, const ip_addr_t* addr, u16_t port) {
+          static_cast<NTP2*>(arg)->rawRecv(p, addr && IP_IS_V4(addr) ? ip4_addr_get_u32(ip_2_ip4(addr)) : 0, port);
+        }, self);
+        if (self->listening) ip_set_option(self->pcb, SOF_BROADCAST);
+#if LWIP_IGMP
+        if (self->listenGroup) {
+          ip4_addr_t group;
+          ip4_addr_set_u32(&group, self->listenGroup);
+          igmp_joingroup(IP4_ADDR_ANY4, &group);
+        }
+#endif
+      }, this);
+    }
+  } else
+#endif
+  // Broadcasts reach the plain socket; a group has to be joined, and a
+  // stack without multicast support still hears broadcasts. A shared
+  // socket is opened by its dispatcher.
+  if (!dispatcher && (!listenGroup || !udp->beginMulticast(IPAddress(listenGroup), NTP_PORT))) {
+    udp->begin(NTP_PORT);
+  }
+  // A warm start already has what a burst would learn, and a listener
+  // sends at most the one calibration request
+  if (iburstEnabled && !provisional && !listening) startBurst();
+  force = !listening || calibrating;
+  lastUpdate = monoMillis() - activeInterval;
+  pollSkew = 0;
+  // Fleet jitter: devices powered up together spread their first request
+  // over the startup window instead of all sending at once
+  if (force && startupJitter != 0) {
+    uint32_t wait = randomBelow(startupJitter < activeInterval ? startupJitter : activeInterval);
+    force = false;
+    lastUpdate += wait;
+  }
 }
 
 void NTP2::stop() {
-  udp->stop();
+#ifdef NTP2_TASK
+  stopTask();
+#endif
+  endCycle();
+#ifdef NTP2_PPS
+  pps(-1);
+#endif
+#ifdef NTP2_LWIP_UDP
+  if (!udp) {
+    if (pcb) {
+      ntp2LwipCall([](void* arg) {
+        NTP2* self = static_cast<NTP2*>(arg);
+#if LWIP_IGMP
+        if (self->listenGroup) {
+          ip4_addr_t group;
+          ip4_addr_set_u32(&group, self->listenGroup);
+          igmp_leavegroup(IP4_ADDR_ANY4, &group);
+        }
+#endif
+        udp_remove(self->pcb);
+      }, this);
+      pcb = nullptr;
+    }
+    for (auto& slot : rxSlots) slot.full = false;
+    return;
+  }
+#endif
+  if (!dispatcher) udp->stop();
+}
+
+void NTP2::endCycle() {
+  // Abandon the poll in flight, if any, without scoring it: replies to it
+  // no longer match, and the server list can be changed again
+  requestTimestamp = 0;
+  pendingCount = 0;
+  for (uint8_t i = 0; i < peerCount; i++) {
+    peers[i].pending = false;
+    peers[i].awaitingDns = false;
+    peers[i].polled = false;
+  }
+}
+
+bool NTP2::addServer(const char* server) {
+  if (!server || peerCount >= NTP_MAX_SERVERS || requestTimestamp != 0) return false;
+  Peer& p = peers[peerCount++];
+  p = Peer();
+  p.host = server;
+  p.status = NTP_IDLE;
+#ifndef NTP2_NO_KOD
+  p.lastKod = NTP_IDLE;
+#endif
+  return true;
+}
+
+bool NTP2::addServer(IPAddress serverIP) {
+  if (peerCount >= NTP_MAX_SERVERS || requestTimestamp != 0) return false;
+  Peer& p = peers[peerCount++];
+  p = Peer();
+  p.ip = serverIP;
+  p.status = NTP_IDLE;
+#ifndef NTP2_NO_KOD
+  p.lastKod = NTP_IDLE;
+#endif
+  return true;
+}
+
+void NTP2::clearServers() {
+  if (requestTimestamp != 0) return;
+  peerCount = 0;
+  syncPeer = -1;
+}
+
+uint8_t NTP2::serverCount() {
+  return peerCount;
 }
 
 void NTP2::updateInterval(unsigned long uInterval) {
+  if (pollMin != 0) {
+    if (uInterval < pollMin) uInterval = pollMin;
+    if (uInterval > pollMax) uInterval = pollMax;
+  }
   activeInterval = defaultInterval = uInterval;
 }
 
+void NTP2::adaptivePoll(uint32_t minInterval, uint32_t maxInterval) {
+  if (minInterval == 0 || maxInterval < minInterval) {
+    pollMin = pollMax = 0;
+    return;
+  }
+  pollMin = minInterval;
+  pollMax = maxInterval;
+  pollCounter = 0;
+  failStreak = 0;
+  // Start from the bottom so the clock and drift estimate settle quickly
+  updateInterval(pollMin);
+}
+
+uint32_t NTP2::pollInterval() {
+  return activeInterval;
+}
+
 void NTP2::responseDelay(uint32_t newDelay) {
   responseDelayValue = newDelay;
 }
@@ -51,26 +315,177 @@ void NTP2::retryDelay(uint32_t newDelay) {
   retryDelayValue = newDelay;
 }
 
-NTPStatus NTP2::forceUpdate() {
+void NTP2::dnsTTL(uint32_t ttl) {
+  dnsTTLValue = ttl;
+  for (uint8_t i = 0; i < peerCount; i++) {
+    if (peers[i].dnsState == DNS_CACHED) peers[i].dnsState = DNS_IDLE;
+  }
+}
+
+void NTP2::resolver(NTPResolver fn) {
+  resolverFn = fn;
+}
+
+void NTP2::iburst(bool enable, uint32_t goodDelay) {
+  iburstEnabled = enable;
+  burstGoodDelay = goodDelay;
+}
+
+// A default seed for pollJitter(): the chip's hardware RNG where the core
+// exposes one, else the boot timing, which identical boards share closely
+static uint32_t hardwareSeed() {
+#if defined(ESP32)
+  return esp_random();
+#elif defined(ESP8266) && defined(RANDOM_REG32)
+  return RANDOM_REG32;
+#elif defined(ARDUINO_ARCH_RP2040) && !defined(ARDUINO_ARCH_MBED)
+  return rp2040.hwrand32();
+#else
+  return NTP2_MICROS() ^ (NTP2_MILLIS() << 16);
+#endif
+}
+
+void NTP2::pollJitter(uint8_t percent, uint32_t startupMax, uint32_t seed) {
+  // Seed with something unique per device (a MAC or chip ID) so a fleet
+  // doesn't draw the same numbers; without one, the hardware RNG is used
+  if (percent > 50) percent = 50;
+  jitterPct = percent;
+  startupJitter = startupMax;
+  if (seed == 0) seed = hardwareSeed();
+  rngState = seed ? seed : 0x9E3779B9UL;
+  for (uint8_t i = 0; i < 4; i++) randomBelow(1);  // spread a low-entropy seed
+}
+
+void NTP2::failover(bool enable) {
+  if (requestTimestamp != 0) return;
+  failoverMode = enable;
+}
+
+#ifndef NTP2_NO_SLEW
+void NTP2::slew(bool enable, uint32_t threshold, uint32_t window, NTPStepHandler onStep) {
+  // The window is kept within micros() range, and the threshold below what
+  // half the window can absorb so the clock always runs forwards
+  if (window > 3600000UL) window = 3600000UL;
+  if (threshold > window / 2) threshold = window / 2;
+  slewThreshold = enable ? threshold * 1000UL : 0;
+  slewWindow = window;
+  stepFn = onStep;
+}
+#endif
+
+uint32_t NTP2::nextWakeMillis() {
+  // A second callback needs update() at each boundary too
+  uint32_t wait = pollWakeMillis();
+  if (secondFn && ntpTimeSeconds != 0) {
+    uint32_t boundary = millisToNextSecond();
+    if (boundary < wait) wait = boundary;
+  }
+  return wait;
+}
+
+uint32_t NTP2::pollWakeMillis() {
+  if (requestTimestamp != 0) {
+#ifdef NTP2_LWIP_UDP
+    // Replies are queued by rawRecv() whether we are awake or not; only
+    // DNS completions and the timeout need a clock
+    if (!udp) {
+      bool dnsWait = false;
+      for (uint8_t i = 0; i < peerCount; i++) dnsWait |= peers[i].awaitingDns;
+      if (!dnsWait) {
+        uint64_t elapsed = monoMillis() - requestTimestamp;
+        return elapsed >= responseDelayValue ? 0 : (uint32_t)(responseDelayValue - elapsed);
+      }
+    }
+#endif
+    // While a request is out the UDP API can only be polled
+    return NTP_RX_POLL;
+  }
+  if (force) return 0;
+  // Client requests and broadcasts need picking up as they come
+  if ((serving || listening) && udp) return NTP_RX_POLL;
+  // A listener done calibrating has nothing of its own to send
+  if (listening && !calibrating) return 0xFFFFFFFF;
+
+  uint64_t elapsed = monoMillis() - lastUpdate;
+  uint32_t due = dueInterval();
+  return elapsed >= due ? 0 : (uint32_t)(due - elapsed);
+}
+
+NTPStatus NTP2::syncOnce() {
+#ifdef NTP2_TASK
+  if (taskHandle) return NTP_BAD_PACKET;
+#endif
+  // One request round, no burst, returning as soon as the replies are in
+  // (or the response timeout passes)
+  burstLeft = 0;
+  if (requestTimestamp == 0) force = true;
+  NTPStatus result;
+  while ((result = update()) == NTP_IDLE) yield();
+  return result;
+}
+
+NTPStatus NTP2::forceUpdate(bool burst) {
+#ifdef NTP2_TASK
+  // The task owns the state machine; hand it the request and wake it
+  if (taskHandle && !inTask()) {
+    __atomic_or_fetch(&taskRequest, burst ? NTP2_TASK_FORCE | NTP2_TASK_BURST : NTP2_TASK_FORCE, __ATOMIC_SEQ_CST);
+    xTaskNotifyGive((TaskHandle_t)taskHandle);
+    return NTP_IDLE;
+  }
+#endif
   if (requestTimestamp != 0) return NTP_BAD_PACKET;
+  if (burst) startBurst();
   force = true;
   return update();
 }
 
+void NTP2::startBurst() {
+  burstLeft = NTP_BURST_COUNT;
+  burstSynced = false;
+}
+
 NTPStatus NTP2::update() {
+#ifdef NTP2_TASK
+  // With a background task running, calls from anywhere else just report
+  if (taskHandle && !inTask()) return ntpSt;
+#endif
+
+  // Keep the published snapshot current: roll the second over for the
+  // epoch() fast path, and now and then fold in drift correction
+  if (snap[0].epochSec != 0) {
+    uint32_t ms = NTP2_MILLIS();
+    if (ms - snap[0].millis >= NTP_EPOCH_REBASE) {
+      publishSnapshot();
+    } else if (ms - snap[0].epochSecMillis >= 1000) {
+      Snapshot next = snap[0];
+      uint32_t sec = (ms - next.epochSecMillis) / 1000;
+      next.epochSec += sec;
+      next.epochSecMillis += sec * 1000;
+      writeSnapshot(next);
+    }
+  }
+
+  if (secondFn) fireSecond();
+
+  if (requestTimestamp == 0 && (serving || listening)) {
+    NTPStatus heard = receivePackets();
+    if (heard != NTP_IDLE) return heard;
+  }
+
   if (requestTimestamp != 0) {
-    if ((int32_t)(millis() - requestTimestamp) >= (int32_t)responseDelayValue) {
-      NTPStatus result = processNTPResponse();
-      if (result == NTP_CONNECTED) {
-        return NTP_CONNECTED;
-      }
-      return result;
-    } else {
-      return NTP_IDLE;
+    // Poll the socket on every call so the sync completes as soon as every
+    // server has answered; responseDelay() is only the give-up timeout.
+    NTPStatus result = processNTPResponse();
+    if (result != NTP_IDLE || requestTimestamp == 0) return result;
+
+    if (monoMillis() - requestTimestamp >= responseDelayValue) {
+      return finishCycle();
     }
+    return NTP_IDLE;
   }
 
-  if (force || (int32_t)(millis() - lastUpdate) >= (int32_t)activeInterval) {
+  // A listener only polls until its calibration exchange succeeds
+  if (force || ((!listening || calibrating) && monoMillis() - lastUpdate >= dueInterval())) {
     return sendNTPRequest();
   }
 
@@ -78,108 +493,1068 @@ NTPStatus NTP2::update() {
 }
 
 NTPStatus NTP2::sendNTPRequest() {
-  lastUpdate = millis();
-  init();
+  lastUpdate = monoMillis();
+  pendingCount = 0;
+  // Roll the skew for whatever interval the cycle sets next
+  if (jitterPct != 0) pollSkew = (int16_t)randomBelow(jitterPct * 20U + 1) - jitterPct * 10;
 
-  bool success = server ? udp->beginPacket(server, NTP_PORT)
-                        : udp->beginPacket(serverIP, NTP_PORT);
+  // One request per server, all on the same socket. Each carries its own
+  // T1, so replies can be told apart by their Originate Timestamp. Demoted
+  // servers sit the poll out; in failover mode only the best-ranked one
+  // not yet tried this round is asked.
+  uint32_t now = NTP2_MILLIS();
+  int8_t only = -1;
+  if (failoverMode) {
+    only = rankedPeer(now);
+    if (only < 0) {
+      // Everyone was tried last round: start again from the top
+      for (uint8_t i = 0; i < peerCount; i++) peers[i].tried = false;
+      only = rankedPeer(now);
+    }
+  }
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    p.pending = false;
+    p.fresh = false;
+    p.awaitingDns = false;
+    p.polled = false;
+    p.status = NTP_BAD_PACKET;
+    if (failoverMode ? i != only : score(p, now) == 0xFFFF) continue;
+    p.polled = true;
+    p.tried = true;
 
-  if (!success || udp->write(ntpRequest, NTP_PACKET_SIZE) != NTP_PACKET_SIZE || !udp->endPacket()) {
-    ntpSt = NTP_BAD_PACKET;
-    return ntpSt;
+    int8_t dns = p.host ? resolveHost(p) : (int8_t)NTP_DNS_READY;
+    if (dns == NTP_DNS_PENDING) {
+      // Sent from processNTPResponse() once the lookup completes
+      p.awaitingDns = true;
+    } else if (dns == NTP_DNS_FAILED || !transmit(p, i, dns == NTP_DNS_READY)) {
+      // A failed lookup skips the server this poll; sending by name would
+      // run the blocking lookup the cache is there to avoid
+      continue;
+    }
+    p.status = NTP_IDLE;
+    p.pending = true;
+    pendingCount++;
+  }
+
+  if (pendingCount == 0) {
+    // Nothing could be sent (every server demoted or unresolvable): try
+    // again after the backoff rather than on every update()
+    force = false;
+    return badRead();
   }
 
-  requestTimestamp = millis();
+  requestTimestamp = monoMillis();
   force = false;
   ntpSt = NTP_IDLE;
   return ntpSt;
 }
 
+bool NTP2::transmit(Peer& p, uint8_t index, bool byIP) {
+  init(p, index);
+  // By name, the UDP stack picks the address and doesn't say which
+  p.sentAddr = byIP ? (uint32_t)p.ip : 0;
+  uint8_t token[8];
+  for (uint8_t i = 0; i < 8; i++) {
+    token[i] = (p.reqTx >> (56 - 8 * i)) & 0xFF;
+  }
+
+#ifdef NTP2_LWIP_UDP
+  if (!udp) {
+    // Raw pcbs only send to addresses; lwIP DNS always supplies one
+    if (!byIP) return false;
+    uint8_t req[NTP_PACKET_SIZE];
+    memcpy(req, ntp2RequestHeader, sizeof(ntp2RequestHeader));
+    memcpy(req + sizeof(ntp2RequestHeader), token, 8);
+    if (!rawSend(req, p.ip, NTP_PORT)) return false;
+    NTP2_COUNT(requests);
+    return true;
+  }
+#endif
+
+  bool success = byIP ? udp->beginPacket(p.ip, NTP_PORT)
+                      : udp->beginPacket(p.host, NTP_PORT);
+
+  success = success &&
+            udp->write(ntp2RequestHeader, sizeof(ntp2RequestHeader)) == sizeof(ntp2RequestHeader) &&
+            udp->write(token, 8) == 8 && udp->endPacket();
+  if (success) NTP2_COUNT(requests);
+  return success;
+}
+
+#ifdef NTP2_LWIP_DNS
+// lwIP may call this from its own thread. It only stores the address (or
+// INADDR_NONE on failure) into the peer's dnsResult; update() picks it up.
+static void ntp2DnsFound(const char *name, const ip_addr_t *addr, void *arg) {
+  (void)name;
+  volatile uint32_t *result = (volatile uint32_t *)arg;
+  if (addr && IP_IS_V4(addr)) *result = ip4_addr_get_u32(ip_2_ip4(addr));
+  else *result = 0xFFFFFFFF;
+}
+#endif
+
+int8_t NTP2::resolveHost(Peer& p) {
+  // Serve from the cache until the TTL runs out or the server has stopped
+  // answering (pool hostnames rotate, the address may simply be gone)
+  if (p.dnsState == DNS_CACHED) {
+    if ((uint32_t)(NTP2_MILLIS() - p.resolvedMillis) < dnsTTLValue && p.failCount < NTP_DNS_MAX_FAILS) {
+      return NTP_DNS_READY;
+    }
+    p.dnsState = DNS_IDLE;
+  }
+
+  if (p.dnsState == DNS_LOOKUP) {
+    uint32_t result = p.dnsResult;
+    if (result == 0) return NTP_DNS_PENDING;
+    p.dnsState = DNS_IDLE;
+    if (result == 0xFFFFFFFF) return NTP_DNS_FAILED;
+    p.ip = IPAddress(result);
+    p.dnsState = DNS_CACHED;
+    p.resolvedMillis = NTP2_MILLIS();
+    p.failCount = 0;
+    return NTP_DNS_READY;
+  }
+
+  // Start a new lookup. A user resolver is synchronous but only runs once
+  // per TTL; the lwIP one returns straight away and completes in the background.
+  if (resolverFn) {
+    IPAddress ip;
+    if (!resolverFn(p.host, ip)) return NTP_DNS_FAILED;
+    p.ip = ip;
+    p.dnsState = DNS_CACHED;
+    p.resolvedMillis = NTP2_MILLIS();
+    p.failCount = 0;
+    return NTP_DNS_READY;
+  }
+
+#ifdef NTP2_LWIP_DNS
+  struct Lookup {
+    Peer* peer;
+    ip_addr_t addr;
+    err_t err;
+  } lookup = {&p, {}, ERR_ARG};
+  p.dnsResult = 0;
+  ntp2LwipCall([](void* arg) {
+    Lookup* l = static_cast<Lookup*>(arg);
+    l->err = dns_gethostbyname(l->peer->host, &l->addr, ntp2DnsFound, (void *)&l->peer->dnsResult);
+  }, &lookup);
+  err_t err = lookup.err;
+  if (err == ERR_OK && IP_IS_V4(&lookup.addr)) {
+    p.ip = IPAddress(ip4_addr_get_u32(ip_2_ip4(&lookup.addr)));
+    p.dnsState = DNS_CACHED;
+    p.resolvedMillis = NTP2_MILLIS();
+    p.failCount = 0;
+    return NTP_DNS_READY;
+  }
+  if (err == ERR_INPROGRESS) {
+    p.dnsState = DNS_LOOKUP;
+    return NTP_DNS_PENDING;
+  }
+#endif
+
+  // No usable resolver: hand the hostname to the UDP stack as before
+  return NTP_DNS_UNCACHED;
+}
+
 NTPStatus NTP2::processNTPResponse() {
-  requestTimestamp = 0;
-  memset(ntpQuery, 0, NTP_PACKET_SIZE);
-  
-  // Read all available packets, keeping the last complete one
-  // This flushes stale packets and handles servers sending extensions
-  bool gotPacket = false;
+  // Send to servers whose DNS lookup has completed since the poll started
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    if (!p.awaitingDns) continue;
+    int8_t dns = resolveHost(p);
+    if (dns == NTP_DNS_PENDING) continue;
+    p.awaitingDns = false;
+    if (dns == NTP_DNS_FAILED || !transmit(p, i, dns == NTP_DNS_READY)) {
+      p.status = NTP_BAD_PACKET;
+      p.pending = false;
+      pendingCount--;
+    }
+  }
+  if (pendingCount == 0) return finishCycle();
+
+  receivePackets();
+  if (pendingCount == 0) return finishCycle();
+  return NTP_IDLE;
+}
+
+NTPStatus NTP2::handlePacket(const Packet& pkt, uint32_t rxMicros, uint32_t rxMillis, IPAddress ip, uint16_t port) {
+  // Client requests are answered in server mode. Replies only matter while
+  // a request is out. Broadcasts are taken in listen mode between
+  // requests, each one a sync of its own.
+  uint8_t mode = pkt.flags & 0x07;
+  if (mode == 3) {
+#ifndef NTP2_NO_SERVE
+    serveRequest(pkt, rxMicros, ip, port);
+#else
+    (void)port;
+#endif
+  } else if (requestTimestamp != 0) decodeResponse(pkt, rxMicros, rxMillis, ip);
+#ifndef NTP2_NO_LISTEN
+  else if (mode == 5 && listening) return decodeBroadcast(pkt, rxMicros, rxMillis, ip);
+#endif
+  return NTP_IDLE;
+}
+
+NTPStatus NTP2::receivePackets() {
+  // The cycle ends once every server has answered; the last broadcast's
+  // result is returned
+  bool inFlight = requestTimestamp != 0;
+  NTPStatus heard = NTP_IDLE;
+
+#ifdef NTP2_LWIP_UDP
+  if (!udp) {
+    // Packets queued by rawRecv(), already trimmed and timestamped
+    for (auto& slot : rxSlots) {
+      if (!slot.full) continue;
+      NTP2_BARRIER();
+      Packet pkt = slot.pkt;
+      uint32_t rxMicros = slot.rxMicros;
+      uint32_t rxMillis = slot.rxMillis;
+      IPAddress ip(slot.ip);
+      uint16_t port = slot.port;
+      NTP2_BARRIER();
+      slot.full = false;
+      NTPStatus result = handlePacket(pkt, rxMicros, rxMillis, ip, port);
+      if (result != NTP_IDLE) heard = result;
+      if (inFlight && pendingCount == 0) return heard;
+    }
+    return heard;
+  }
+#endif
+
+  // On a shared socket the dispatcher does the reading
+  if (dispatcher) return heard;
+
+  // Drain whatever is queued, a bounded batch per call. Undersized packets
+  // and replies whose Originate Timestamp matches none of our tokens are
+  // stale or unrelated: drop them and keep waiting.
   int packetSize;
-  while ((packetSize = udp->parsePacket()) > 0) {
-    if (packetSize >= NTP_PACKET_SIZE) {
-      udp->read(ntpQuery, NTP_PACKET_SIZE);
-      // Discard any trailing bytes (extension fields, padding)
-      while (udp->available()) udp->read();
-      gotPacket = true;
-    } else {
+  for (uint8_t n = 0; n < NTP_SERVE_BATCH && (packetSize = udp->parsePacket()) > 0; n++) {
+    // T4: take the receive time before doing anything else with the packet
+    uint32_t rxMicros = (uint32_t)monoMicros();
+    uint32_t rxMillis = NTP2_MILLIS();
+    if (packetSize < NTP_PACKET_SIZE) {
       // Undersized packet — discard entirely
+      NTP2_COUNT(undersized);
       while (udp->available()) udp->read();
+      continue;
     }
+    Packet pkt;
+    readPacket(pkt);
+    // Discard any trailing bytes (extension fields, padding)
+    while (udp->available()) udp->read();
+
+    NTPStatus result = handlePacket(pkt, rxMicros, rxMillis, udp->remoteIP(), udp->remotePort());
+    if (result != NTP_IDLE) heard = result;
+    if (inFlight && pendingCount == 0) return heard;
   }
-  
-  if (!gotPacket) {
-    return badRead();
+  return heard;
+}
+
+#ifdef NTP2_LWIP_UDP
+bool NTP2::rawSend(const uint8_t* data, IPAddress ip, uint16_t port) {
+  if (!pcb) return false;
+  struct Send {
+    struct udp_pcb* pcb;
+    const uint8_t* data;
+    ip_addr_t addr;
+    uint16_t port;
+    err_t err;
+  } send = {pcb, data, {}, port, ERR_MEM};
+  IP_ADDR4(&send.addr, ip[0], ip[1], ip[2], ip[3]);
+  ntp2LwipCall([](void* arg) {
+    Send* s = static_cast<Send*>(arg);
+    struct pbuf* pb = pbuf_alloc(PBUF_TRANSPORT, NTP_PACKET_SIZE, PBUF_RAM);
+    if (!pb) return;
+    memcpy(pb->payload, s->data, NTP_PACKET_SIZE);
+    s->err = udp_sendto(s->pcb, pb, &s->addr, s->port);
+    pbuf_free(pb);
+  }, &send);
+  return send.err == ERR_OK;
+}
+
+void NTP2::rawRecv(struct pbuf* p, uint32_t ip, uint16_t port) {
+  // Runs in the lwIP thread. T4 is taken here, as the packet comes off
+  // the driver, and only the fields we use are kept from the header;
+  // update() decodes them later.
+  uint32_t rxMicros = NTP2_MICROS();
+  uint32_t rxMillis = NTP2_MILLIS();
+  if (p->tot_len >= NTP_PACKET_SIZE) {
+    for (auto& slot : rxSlots) {
+      if (slot.full) continue;
+      uint8_t hdr[NTP_PACKET_SIZE];
+      pbuf_copy_partial(p, hdr, NTP_PACKET_SIZE, 0);
+      // Client requests are only of interest to server mode
+      if ((hdr[0] & 0x07) == 3 && !serving) break;
+      unpack(hdr, slot.pkt);
+      slot.rxMicros = rxMicros;
+      slot.rxMillis = rxMillis;
+      slot.ip = ip;
+      slot.port = port;
+      NTP2_BARRIER();
+      slot.full = true;
+      break;
+    }
+#ifdef NTP2_TASK
+    // Read once: taskLoop() clears it in this thread on its way out
+    void* task = taskHandle;
+    if (task) xTaskNotifyGive((TaskHandle_t)task);
+#endif
   }
+  pbuf_free(p);
+}
+#endif
+
+void NTP2::readPacket(Packet& pkt) {
+  // Field by field straight off the socket; only what decodeResponse()
+  // uses is kept
+  uint8_t b[8];
+  udp->read(b, 4);
+  pkt.flags = b[0];
+  pkt.stratum = b[1];
+  pkt.poll = b[2];
+  pkt.rootDelay = read32();
+  pkt.rootDisp = read32();
+  pkt.refId = read32();
+  udp->read(b, 8);  // Reference Timestamp
+  pkt.org = read64();
+  pkt.rx = read64();
+  pkt.tx = read64();
+}
 
-  uint8_t mode = ntpQuery[0] & 0x07;
-  uint8_t stratum = ntpQuery[1];
+uint32_t NTP2::read32() {
+  uint8_t b[4] = {0, 0, 0, 0};
+  udp->read(b, 4);
+  return be32(b);
+}
+
+uint64_t NTP2::read64() {
+  uint64_t hi = read32();
+  return (hi << 32) | read32();
+}
+
+void NTP2::unpack(const uint8_t* hdr, Packet& pkt) {
+  pkt.flags = hdr[0];
+  pkt.stratum = hdr[1];
+  pkt.poll = hdr[2];
+  pkt.rootDelay = be32(&hdr[4]);
+  pkt.rootDisp = be32(&hdr[8]);
+  pkt.refId = be32(&hdr[12]);
+  pkt.org = ((uint64_t)be32(&hdr[24]) << 32) | be32(&hdr[28]);
+  pkt.rx = ((uint64_t)be32(&hdr[32]) << 32) | be32(&hdr[36]);
+  pkt.tx = ((uint64_t)be32(&hdr[40]) << 32) | be32(&hdr[44]);
+}
+
+uint8_t NTP2::claim(const Packet& pkt, IPAddress ip) {
+  // How sure we are a packet on a shared socket is ours: 3 it carries one
+  // of our tokens, 2 it comes from a server we are waiting on (a KoD
+  // without the token, or a stale reply), 1 it is a request or broadcast
+  // we take, 0 not ours
+  uint8_t mode = pkt.flags & 0x07;
+  if (mode == 3) return serving ? 1 : 0;
+  if (requestTimestamp != 0) {
+    uint8_t score = 0;
+    for (uint8_t i = 0; i < peerCount; i++) {
+      if (!peers[i].pending) continue;
+      if (peers[i].reqTx == pkt.org) return 3;
+      if (peers[i].sentAddr == (uint32_t)ip || peers[i].sentAddr == 0) score = 2;
+    }
+    return score;
+  }
+  return mode == 5 && listening ? 1 : 0;
+}
+
+void NTP2::decodeResponse(const Packet& pkt, uint32_t rxMicros, uint32_t rxMillis, IPAddress ip) {
+  // Correlate response to one of our outstanding requests by checking the
+  // Originate Timestamp. This prevents accepting stale/unrelated packets.
+  Peer* peer = nullptr;
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    if (p.pending && p.reqTx == pkt.org) {
+      peer = &p;
+      break;
+    }
+  }
+
+  uint8_t mode = pkt.flags & 0x07;
+  uint8_t stratum = pkt.stratum;
 
   // Check for Kiss-o'-Death
   if (stratum == 0 && (mode == 4 || mode == 5)) {
-    char kod[5] = {ntpQuery[12], ntpQuery[13], ntpQuery[14], ntpQuery[15], '\0'};
-    for (auto& k : kodLookup) {
-      if (strcmp(kod, k.code) == 0) {
-        activeInterval = retryDelayValue;
-        ntpSt = static_cast<NTPStatus>(k.ret);
-        return ntpSt;
+    // Not every server echoes the token in a KoD; with a single request
+    // out, one from the address it was sent to (or any, if it went by
+    // name) is taken as its answer. Only a token match is trusted enough
+    // to demote the server, as the address alone is easily spoofed.
+    bool matched = peer != nullptr;
+    if (!peer && pendingCount == 1) {
+      for (uint8_t i = 0; i < peerCount; i++) {
+        Peer& p = peers[i];
+        if (p.pending && (p.sentAddr == (uint32_t)ip || p.sentAddr == 0)) peer = &p;
       }
     }
-    activeInterval = retryDelayValue;
-    ntpSt = NTP_UNKNOWN_KOD;
-    return ntpSt;
-  }
+    if (!peer) return;
 
-  // Correlate response to our most recent request by checking Originate Timestamp.
-  // This prevents accepting stale/unrelated packets.
-  uint32_t orgSec  = ((uint32_t)ntpQuery[24] << 24) |
-                     ((uint32_t)ntpQuery[25] << 16) |
-                     ((uint32_t)ntpQuery[26] << 8)  |
-                     (uint32_t)ntpQuery[27];
-  uint32_t orgFrac = ((uint32_t)ntpQuery[28] << 24) |
-                     ((uint32_t)ntpQuery[29] << 16) |
-                     ((uint32_t)ntpQuery[30] << 8)  |
-                     (uint32_t)ntpQuery[31];
+#ifndef NTP2_NO_KOD
+    NTPStatus code = classifyKod(pkt.refId);
+    peer->status = code;
+    peer->lastKod = code;
+    if (peer->kodCount < 0xFFFF) peer->kodCount++;
+    uint16_t& total = kodCounts[code - NTP_KOD_RATE];
+    if (total < 0xFFFF) total++;
+#else
+    peer->status = NTP_UNKNOWN_KOD;
+#endif
+    // A server that denied us access is left alone for a long while; other
+    // KoDs only count as a miss in its score, and the backoff slows us down
+    if (matched && (pkt.refId == kodCode("DENY") || pkt.refId == kodCode("RSTR"))) {
+      peer->demoted = true;
+      peer->demotedUntil = NTP2_MILLIS() + NTP_DEMOTE_DENY;
+    }
+    peer->pending = false;
+    pendingCount--;
+    return;
+  }
 
-  if (orgSec != reqTxSec || orgFrac != reqTxFrac) {
-    return badRead();
+  // Not ours (stale or from an earlier request): keep waiting
+  if (!peer) {
+#ifdef NTP2_STATS
+    // A late or duplicate answer to this poll, or nothing we sent
+    bool stale = false;
+    for (uint8_t i = 0; i < peerCount; i++) stale |= peers[i].reqTx == pkt.org;
+    if (stale) NTP2_COUNT(stale);
+    else NTP2_COUNT(mismatched);
+#endif
+    return;
   }
+  peer->pending = false;
+  pendingCount--;
+  peer->status = NTP_BAD_PACKET;
+
+  // T2 (server Receive) and T3 (server Transmit)
+  uint32_t txSec = (uint32_t)(pkt.tx >> 32);
 
-  // Extract transmit timestamp
-  uint32_t txSec = ((uint32_t)ntpQuery[40] << 24) |
-                   ((uint32_t)ntpQuery[41] << 16) |
-                   ((uint32_t)ntpQuery[42] << 8)  |
-                   (uint32_t)ntpQuery[43];
-  uint32_t txFrac = ((uint32_t)ntpQuery[44] << 24) |
-                    ((uint32_t)ntpQuery[45] << 16) |
-                    ((uint32_t)ntpQuery[46] << 8)  |
-                    (uint32_t)ntpQuery[47];
-  
   // Validate transmit timestamp is non-zero
-  if (txSec == 0) return badRead();
-  
-  uint32_t fracMillis = (uint32_t)((uint64_t)txFrac * 1000 / 0x100000000ULL);
+  if (txSec == 0) {
+    NTP2_COUNT(badTime);
+    return;
+  }
+
+  if (!checkValid(pkt, txSec)) return;
+
+  // Some minimal servers leave Receive empty; treat it as equal to Transmit
+  uint64_t t3 = pkt.tx;
+  uint64_t t2 = (pkt.rx >> 32) ? pkt.rx : t3;
+
+  // RFC 5905 on-wire calculation, in 32.32 fixed point with the server's
+  // full fractions:
+  //   offset = ((T2 - T1) + (T3 - T4)) / 2
+  //   delay  =  (T4 - T1) - (T3 - T2)
+  // T1 and T4 are on our local timescale (see localNtpTime()), so their
+  // difference is exactly the micros() elapsed while the request was out.
+  uint64_t t1 = peer->reqTx;
+  uint64_t t4 = t1 + (uint64_t)microsToNtp(rxMicros - peer->reqLocalMicros);
 
-  if (!checkValid(txSec)) return badRead();
+  // The server can't have held the request for longer than it was out
+  // (beyond a microsecond of rounding); Receive after Transmit, or a
+  // turnaround longer than the round trip, is a corrupt timestamp
+  uint64_t roundTrip = t4 - t1;
+  uint64_t turnaround = t3 - t2;
+  if ((int64_t)turnaround < 0 || turnaround > roundTrip + (uint64_t)microsToNtp(1)) {
+    NTP2_COUNT(badTime);
+    return;
+  }
+
+  // Halve before adding: before the first sync each term can span years
+  int64_t offset = ((int64_t)(t2 - t1) >> 1) + ((int64_t)(t3 - t4) >> 1);
+  int64_t delay  = (int64_t)(roundTrip - turnaround);
+  if (delay < 0) delay = 0;  // server turnaround rounded past our resolution
+
+  // Sample dispersion: the server's own error bound (root dispersion plus
+  // half its root delay, both 16.16 seconds) plus our 1 us resolution
+  uint32_t rootDelay = (uint32_t)(((uint64_t)pkt.rootDelay * 1000000ULL) >> 16);
+  uint32_t rootDisp  = (uint32_t)(((uint64_t)pkt.rootDisp * 1000000ULL) >> 16);
+
+  // Against the clock as it will be once any slew in progress is done
+  peer->offset = ntpToMicros(offset) - slewPending(monoMicros());
+  peer->delay = (uint32_t)ntpToMicros(delay);
+  peer->disp = rootDisp + rootDelay / 2 + 1;
+  // What a downstream client of server mode needs to know about us
+  peer->leap = pkt.flags >> 6;
+  peer->stratum = pkt.stratum;
+  peer->rootDelay = pkt.rootDelay;
+  peer->rootDisp = pkt.rootDisp;
+  peer->rxMillis = rxMillis;
+  peer->fresh = true;
+  peer->status = NTP_CONNECTED;
 
-  ntpTimeSeconds = txSec;
-  lastSyncMillis = millis();
-  // Fix overflow: cast txSec to uint64_t before multiplication
-  ntpMillisAtSync = ((uint64_t)txSec * 1000ULL) + fracMillis;
+  // Listen mode: the first exchange measures the path broadcasts travel
+#ifndef NTP2_NO_LISTEN
+  if (calibrating) {
+    bcastDelayUs = peer->delay / 2;
+    calibrating = false;
+  }
+#endif
+
+#ifdef NTP2_STATS
+  st.replies++;
+  if (peer->delay < st.rttMin) st.rttMin = peer->delay;
+  if (peer->delay > st.rttMax) st.rttMax = peer->delay;
+  rttSum += peer->delay;
+#ifdef NTP2_STATS_HISTOGRAM
+  // Bin i holds RTTs below 2^i ms
+  uint8_t bin = 0;
+  for (uint32_t ms = peer->delay / 1000; ms && bin < NTP_STATS_HIST_BINS - 1; ms >>= 1) bin++;
+  if (st.rttHist[bin] < 0xFFFF) st.rttHist[bin]++;
+#endif
+#endif
+}
+
+#ifndef NTP2_NO_LISTEN
+NTPStatus NTP2::decodeBroadcast(const Packet& pkt, uint32_t rxMicros, uint32_t rxMillis, IPAddress ip) {
+  // A broadcasting server is a peer like any other, found by address.
+  // Only a valid broadcast gets that far, so a stray packet can't take a
+  // slot.
+  if (!checkValid(pkt, (uint32_t)(pkt.tx >> 32))) return NTP_IDLE;
+  int8_t index = -1;
+  for (uint8_t i = 0; i < peerCount; i++) {
+    if ((uint32_t)peers[i].ip == (uint32_t)ip) index = i;
+  }
+  if (index < 0) index = learnPeer(ip);
+  if (index < 0) return NTP_IDLE;
+
+  // One way only: offset = T3 + path delay - T4, with T4 moved back to
+  // the arrival time on our clock
+  uint64_t nowMicros = monoMicros();
+  uint64_t t4 = localNtpTime(nowMicros) - (uint64_t)microsToNtp((uint32_t)nowMicros - rxMicros);
+  uint32_t rootDelay = (uint32_t)(((uint64_t)pkt.rootDelay * 1000000ULL) >> 16);
+  uint32_t rootDisp  = (uint32_t)(((uint64_t)pkt.rootDisp * 1000000ULL) >> 16);
+
+  // Each broadcast is a cycle of its own, with this server the only one
+  // heard; the delay is the round trip the calibration implies
+  // (the others learned from broadcasts age by a miss)
+  for (uint8_t i = 0; i < peerCount; i++) {
+    peers[i].fresh = false;
+    if (peers[i].learned) peers[i].polled = true;
+  }
+  Peer& p = peers[index];
+  p.offset = ntpToMicros((int64_t)(pkt.tx - t4)) + bcastDelayUs - slewPending(nowMicros);
+  p.delay = 2 * bcastDelayUs;
+  p.disp = rootDisp + rootDelay / 2 + 1;
+  p.leap = pkt.flags >> 6;
+  p.stratum = pkt.stratum;
+  p.rootDelay = pkt.rootDelay;
+  p.rootDisp = pkt.rootDisp;
+  p.rxMillis = rxMillis;
+  p.fresh = true;
+  p.polled = true;
+  p.status = NTP_CONNECTED;
+  NTP2_COUNT(broadcasts);
+  return finishCycle();
+}
+
+int8_t NTP2::learnPeer(IPAddress ip) {
+  // A broadcaster we haven't heard from before takes a free slot, or else
+  // that of another one learned from broadcasts that has gone quiet: each
+  // newcomer turned away counts as a miss for those, and one with no
+  // reply among its last 8 polls gives its slot up
+  if (addServer(ip)) {
+    peers[peerCount - 1].learned = true;
+    return peerCount - 1;
+  }
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    if (!p.learned) continue;
+    p.reach <<= 1;
+    if (p.reach != 0) continue;
+    p = Peer();
+    p.ip = ip;
+    p.status = NTP_IDLE;
+#ifndef NTP2_NO_KOD
+    p.lastKod = NTP_IDLE;
+#endif
+    p.learned = true;
+    if (syncPeer == (int8_t)i) syncPeer = -1;
+    return i;
+  }
+  return -1;
+}
+
+#endif
+
+NTPStatus NTP2::finishCycle() {
+  requestTimestamp = 0;
+  pendingCount = 0;
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    p.pending = false;
+    p.awaitingDns = false;
+    if (!p.polled) {
+      // Failover only asks the best-ranked server, so the others' records
+      // would never change; age them instead, forgiving one miss every
+      // NTP_FAILOVER_AGE polls, so a recovered server is asked again once
+      // it ranks first. One still down just costs that poll a timeout.
+      if (failoverMode && !p.demoted && p.reach != 0xFF && ++p.idlePolls >= NTP_FAILOVER_AGE) {
+        p.reach |= p.reach + 1;
+        p.idlePolls = 0;
+      }
+      continue;
+    }
+    p.polled = false;
+    p.idlePolls = 0;
+    p.reach = (p.reach << 1) | (p.fresh ? 1 : 0);
+    // Too many silent polls in a row flush the cached address
+    if (p.fresh) p.failCount = 0;
+    else if (p.failCount < 0xFF) p.failCount++;
+  }
+
+  bool bursting = burstLeft > 0;
+  if (bursting) burstLeft--;
+
+  // Before the first sync there is no local clock to be relative to, so
+  // step straight onto the lowest-delay reply; the same goes for a clock
+  // restored from saved state, which may be far off. Everything after that,
+  // including the samples kept in the filters, is a small correction.
+  int64_t step = 0;
+  bool initialStep = false;
+  if (ntpTimeSeconds == 0 || provisional) {
+    int8_t first = -1;
+    for (uint8_t i = 0; i < peerCount; i++) {
+      if (peers[i].fresh && (first < 0 || peers[i].delay < peers[first].delay)) first = i;
+    }
+    if (first >= 0) {
+      step = peers[first].offset;
+      stepClock(step);
+      provisional = false;
+      initialStep = true;
+    }
+  }
+
+  uint32_t now = NTP2_MILLIS();
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    if (p.fresh) addSample(p);
+    if (p.filterCount) clockFilter(p, now);
+  }
+
+  int8_t best = selectPeer();
+  // Failover: the server asked let us down, so go straight on to the next
+  // in the ranking instead of waiting out the retry delay
+  if (best < 0 && failoverMode && rankedPeer(now) >= 0) {
+    if (bursting) burstLeft++;
+    force = true;
+    ntpSt = NTP_IDLE;
+    return ntpSt;
+  }
+  for (uint8_t i = 0; i < peerCount; i++) peers[i].tried = false;
+  if (best < 0) {
+    // Nobody usable answered. A KoD takes precedence over plain silence so
+    // callers can see why they are being refused; it also ends a burst, as
+    // hammering a server that is refusing us only makes things worse.
+    for (uint8_t i = 0; i < peerCount; i++) {
+      if (peers[i].status >= NTP_KOD_RATE) {
+        burstLeft = 0;
+        activeInterval = backoff();
+        ntpSt = peers[i].status;
+        return ntpSt;
+      }
+    }
+    if (!bursting) return badRead();
+    if (burstLeft > 0) {
+      activeInterval = NTP_BURST_SPACING;
+      ntpSt = NTP_IDLE;
+      return ntpSt;
+    }
+    // Burst over: succeed on whatever the earlier shots provided
+    if (!burstSynced) return badRead();
+    activeInterval = defaultInterval;
+    ntpSt = NTP_CONNECTED;
+    return ntpSt;
+  }
+
+  // Only a sample we haven't acted on yet moves the clock. When the filter
+  // still prefers an older, lower-delay sample, a delayed reply is ignored.
+  Peer& p = peers[best];
+  int32_t correction = 0;
+  if (p.fRxMillis != p.usedRxMillis) {
+    correction = p.fOffset;
+    // The sample's receive time on the 64-bit base, so a span across a
+    // long outage still comes out positive
+    uint64_t sampleMillis = monoMillis() - (uint32_t)(NTP2_MILLIS() - p.fRxMillis);
+    int32_t freq = estimateFrequency(correction, sampleMillis);
+    stepClock(correction);
+    freqPpb = freq;  // after the step, which anchors the clock with the old rate
+    publishSnapshot();
+    step += correction;
+    p.usedRxMillis = p.fRxMillis;
+  }
+
+  // An initial step measures how far off there was no clock, or only a
+  // guessed one, not our clock's error; offset() keeps the last real one
+  // (0 before any, or the one restored with the saved state)
+  if (!initialStep) offsetMs = clamp32(step / 1000);
+  delayMs = p.fDelay / 1000;
+  syncPeer = best;
+
+  failStreak = 0;
+  if (!bursting) adaptInterval(correction, p.fJitter);
   if (activeInterval != defaultInterval) activeInterval = defaultInterval;
+  lastResponseMillis = NTP2_MILLIS();
+
+  // Burst: every shot feeds the filter (and the clock, so epoch() is usable
+  // after the first reply), but a sync is only reported once the filtered
+  // delay is good enough or the burst runs out.
+  if (bursting) {
+    burstSynced = true;
+    if (p.fDelay > burstGoodDelay * 1000UL && burstLeft > 0) {
+      activeInterval = NTP_BURST_SPACING;
+      ntpSt = NTP_IDLE;
+      return ntpSt;
+    }
+    burstLeft = 0;
+    // Start drift measurement from the settled clock, not the first shots
+    freqAnchorMillis = monoMillis();
+    freqAccum = 0;
+  }
+
+  if (stateSaveFn) autoSave();
 
-  lastResponseMillis = millis();
   ntpSt = NTP_CONNECTED;
   return NTP_CONNECTED;
 }
 
+void NTP2::persist(NTPStateSave save, NTPStateLoad load, uint32_t minInterval) {
+  stateSaveFn = save;
+  stateLoadFn = load;
+  saveMinInterval = minInterval;
+}
+
+void NTP2::autoSave() {
+  // A sync changes the saved time and offset every time, but a warm start
+  // only needs them roughly, so those alone wait for the interval. What
+  // would make a restore start off worse is saved at once.
+  uint32_t now = NTP2_MILLIS();
+  int32_t freqMove = freqPpb - savedFreqPpb;
+  if (freqMove < 0) freqMove = -freqMove;
+  bool changed = !savedOnce || syncPeer != savedPeer || defaultInterval != savedInterval ||
+                 freqValid != savedFreqValid || freqMove >= NTP_STATE_SAVE_PPB;
+  if (!changed && now - savedAtMillis < saveMinInterval) return;
+
+  uint8_t blob[NTP_STATE_SIZE];
+  size_t len = saveState(blob, sizeof(blob));
+  if (len == 0) return;
+  stateSaveFn(blob, len);
+  savedAtMillis = now;
+  savedInterval = defaultInterval;
+  savedFreqPpb = freqPpb;
+  savedPeer = syncPeer;
+  savedFreqValid = freqValid;
+  savedOnce = true;
+}
+
+size_t NTP2::saveState(uint8_t* blob, size_t len) {
+  // Version 1, big-endian:
+  //   0 magic, 1 version, 2 NTP time (32.32), 10 frequency (ppb),
+  //   14 flags, 15 sync server, 16 poll interval (ms), 20 offset (ms),
+  //   24 Fletcher-16 of bytes 0-23
+  if (!blob || len < NTP_STATE_SIZE || ntpTimeSeconds == 0) return 0;
+  uint64_t now = localNtpTime(monoMicros());
+  blob[0] = NTP_STATE_MAGIC;
+  blob[1] = NTP_STATE_VERSION;
+  put32(&blob[2], (uint32_t)(now >> 32));
+  put32(&blob[6], (uint32_t)now);
+  put32(&blob[10], (uint32_t)freqPpb);
+  blob[14] = freqValid ? 0x01 : 0x00;
+  blob[15] = (uint8_t)syncPeer;
+  put32(&blob[16], defaultInterval);
+  put32(&blob[20], (uint32_t)offsetMs);
+  uint16_t sum = fletcher16(blob, NTP_STATE_SIZE - 2);
+  blob[24] = sum >> 8;
+  blob[25] = sum & 0xFF;
+  return NTP_STATE_SIZE;
+}
+
+bool NTP2::restoreState(const uint8_t* blob, size_t len, uint32_t elapsedMs) {
+  if (!blob || len < NTP_STATE_SIZE || requestTimestamp != 0) return false;
+  if (blob[0] != NTP_STATE_MAGIC || blob[1] != NTP_STATE_VERSION) return false;
+  if (fletcher16(blob, NTP_STATE_SIZE - 2) != (uint16_t)((blob[24] << 8) | blob[25])) return false;
+
+  // The saved time plus however long it has been since it was saved gives
+  // a provisional clock; the first reply steps it like a first sync would
+  uint64_t saved = ((uint64_t)be32(&blob[2]) << 32) | be32(&blob[6]);
+  ntpAtSync = saved + (uint64_t)microsToNtp((int64_t)elapsedMs * 1000LL);
+  lastSyncMicros = monoMicros();
+  ntpTimeSeconds = (uint32_t)(ntpAtSync >> 32);
+  provisional = true;
+#ifndef NTP2_NO_SLEW
+  slewTotal = 0;
+  slewSpan = 0;
+#endif
+
+  freqPpb = (int32_t)be32(&blob[10]);
+  if (freqPpb > NTP_FREQ_MAX || freqPpb < -NTP_FREQ_MAX) freqPpb = 0;
+  freqValid = (blob[14] & 0x01) != 0;
+  freqAnchorMillis = monoMillis();
+  freqAccum = 0;
+
+  // -1 is a blob saved before any sync; anything else out of range is a
+  // server list that has changed since, or a corrupt byte
+  int8_t server = (int8_t)blob[15];
+  syncPeer = server >= 0 && server < (int8_t)peerCount ? server : -1;
+  uint32_t interval = be32(&blob[16]);
+  if (pollMin != 0 && interval >= pollMin && interval <= pollMax) defaultInterval = interval;
+  offsetMs = (int32_t)be32(&blob[20]);
+
+  publishSnapshot(true);
+  return true;
+}
+
+void NTP2::put32(uint8_t* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+uint16_t NTP2::fletcher16(const uint8_t* p, size_t len) {
+  uint16_t a = 0, b = 0;
+  while (len--) {
+    a = (a + *p++) % 255;
+    b = (b + a) % 255;
+  }
+  return (b << 8) | a;
+}
+
+void NTP2::adaptInterval(int32_t correction, uint32_t jitter) {
+  // Modeled on the RFC 5905 poll exponent: while corrections stay within a
+  // few jitters (plus a small floor for our 1 ms resolution) the interval
+  // doubles every NTP_POLL_HYSTERESIS polls, up to the maximum. A larger
+  // correction halves it at once, down to the minimum.
+  if (pollMin == 0) return;
+  uint32_t limit = NTP_POLL_GATE * jitter + NTP_POLL_TOLERANCE * 1000UL;
+  uint32_t absCorrection = correction < 0 ? -(uint32_t)correction : (uint32_t)correction;
+
+  if (absCorrection <= limit) {
+    if (++pollCounter >= NTP_POLL_HYSTERESIS) {
+      pollCounter = 0;
+      defaultInterval = defaultInterval > pollMax / 2 ? pollMax : defaultInterval * 2;
+    }
+  } else {
+    pollCounter = 0;
+    defaultInterval = defaultInterval / 2 < pollMin ? pollMin : defaultInterval / 2;
+  }
+}
+
+uint32_t NTP2::backoff() {
+  // Fixed retry delay by default. In adaptive mode each consecutive failure
+  // doubles it, up to the maximum poll interval, so a refusing or dead
+  // upstream isn't hammered every 30 s. With fleet jitter it doubles up to
+  // the poll interval as well, and each delay is drawn from its upper
+  // half, so devices refused together don't all come back together.
+  if (pollMin == 0 && jitterPct == 0) return retryDelayValue;
+  if (failStreak < 0xFF) failStreak++;
+  uint32_t limit = pollMin != 0 ? pollMax : defaultInterval;
+  uint32_t cap = limit > retryDelayValue ? limit : retryDelayValue;
+  uint32_t delay = retryDelayValue;
+  for (uint8_t i = 1; i < failStreak && delay < cap; i++) {
+    delay = delay > cap / 2 ? cap : delay * 2;
+  }
+  if (jitterPct != 0) delay = delay / 2 + randomBelow(delay / 2 + 1);
+  return delay;
+}
+
+uint32_t NTP2::dueInterval() {
+  // The interval in use, skewed by this cycle's jitter
+  if (pollSkew == 0) return activeInterval;
+  return (uint32_t)((int64_t)activeInterval + (int64_t)activeInterval * pollSkew / 1000);
+}
+
+uint32_t NTP2::randomBelow(uint32_t n) {
+  // xorshift32, scaled without a divide
+  uint32_t x = rngState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  rngState = x;
+  return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+int32_t NTP2::estimateFrequency(int32_t correction, uint64_t sampleMillis) {
+  // The corrections made since the anchor add up to our oscillator's
+  // frequency error (beyond what freqPpb already removes) integrated over
+  // that span. Spans shorter than NTP_FREQ_MIN_SPAN say more about jitter
+  // than about the crystal, so corrections keep accumulating until the
+  // span is long enough, whatever the poll interval. A rate no crystal
+  // could have means a step or a server change and is discarded.
+  freqAccum += correction;
+  int64_t span = (int64_t)(sampleMillis - freqAnchorMillis);
+  if (span < (int64_t)NTP_FREQ_MIN_SPAN) return freqPpb;
+
+  // us per ms is parts per thousand; ppb is a further 10^6
+  int64_t residual = ((int64_t)freqAccum * 1000000LL) / span;
+  freqAnchorMillis = sampleMillis;
+  freqAccum = 0;
+  if (residual > NTP_FREQ_MAX || residual < -NTP_FREQ_MAX) return freqPpb;
+  // The first estimate is taken whole; later ones are blended in at 1/4
+  // so a single noisy sample can't swing the rate
+  int64_t freq = freqValid ? freqPpb + residual / 4 : freqPpb + residual;
+  freqValid = true;
+  if (freq > NTP_FREQ_MAX) freq = NTP_FREQ_MAX;
+  if (freq < -NTP_FREQ_MAX) freq = -NTP_FREQ_MAX;
+  return (int32_t)freq;
+}
+
+void NTP2::stepClock(int64_t correction) {
+  // Whatever an earlier slew still owes is folded into this correction.
+  // In slew mode a small total re-anchors the clock where it is and is
+  // worked off over the window; anything else, or any correction outside
+  // slew mode, steps it.
+  uint64_t now = monoMicros();
+  int64_t target = slewPending(now) + correction;
+  int64_t size = target < 0 ? -target : target;
+  bool slewing = slewThreshold != 0 && ntpTimeSeconds != 0 && !provisional && size < (int64_t)slewThreshold;
+  ntpAtSync = localNtpTime(now) + (slewing ? 0 : (uint64_t)microsToNtp(target));
+#ifndef NTP2_NO_SLEW
+  if (!slewing && slewThreshold != 0 && ntpTimeSeconds != 0 && stepFn) stepFn(clamp32(target / 1000));
+  slewTotal = slewing ? (int32_t)target : 0;
+  slewSpan = slewing ? slewWindow * 1000UL : 0;
+#endif
+  lastSyncMicros = now;
+  if (ntpTimeSeconds == 0 || provisional) {
+    freqAnchorMillis = monoMillis();
+    freqAccum = 0;
+  }
+  ntpTimeSeconds = (uint32_t)(ntpAtSync >> 32);
+  publishSnapshot(!slewing);
+
+  // Offsets are relative to our clock; keep them that way
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    if (p.fresh) p.offset -= correction;
+    for (uint8_t k = 0; k < p.filterCount; k++) {
+      p.filter[k].offset = clamp32(p.filter[k].offset - correction);
+    }
+    p.fOffset = clamp32(p.fOffset - correction);
+  }
+}
+
+void NTP2::addSample(Peer& p) {
+  Sample& s = p.filter[p.filterHead];
+  s.offset = clamp32(p.offset);
+  s.delay = p.delay;
+  s.disp = p.disp;
+  s.rxMillis = p.rxMillis;
+  p.filterHead = (p.filterHead + 1) % NTP_FILTER_SIZE;
+  if (p.filterCount < NTP_FILTER_SIZE) p.filterCount++;
+}
+
+void NTP2::clockFilter(Peer& p, uint32_t now) {
+  // RFC 5905 clock filter: the sample with the smallest distance (half its
+  // delay plus its dispersion, which grows at 15 ppm with age) is the one
+  // least disturbed by queueing on the path. Jitter is the RMS of the other
+  // samples' offsets around it.
+  uint8_t bestIdx = 0;
+  uint32_t bestDist = UINT32_MAX;
+  uint32_t bestDisp = 0;
+  for (uint8_t k = 0; k < p.filterCount; k++) {
+    Sample& s = p.filter[k];
+    uint32_t disp = s.disp + ((now - s.rxMillis) / 1000UL) * 15UL;
+    uint32_t dist = s.delay / 2 + disp;
+    // On a tie the newer sample wins
+    if (dist < bestDist || (dist == bestDist && (int32_t)(s.rxMillis - p.filter[bestIdx].rxMillis) > 0)) {
+      bestDist = dist;
+      bestDisp = disp;
+      bestIdx = k;
+    }
+  }
+
+  Sample& b = p.filter[bestIdx];
+  p.fOffset = b.offset;
+  p.fDelay = b.delay;
+  p.fDisp = bestDisp;
+  p.fRxMillis = b.rxMillis;
+
+  uint64_t sum = 0;
+  for (uint8_t k = 0; k < p.filterCount; k++) {
+    int64_t d = (int64_t)p.filter[k].offset - b.offset;
+    sum += (uint64_t)(d * d);
+  }
+  p.fJitter = p.filterCount > 1 ? isqrt(sum / (p.filterCount - 1)) : 0;
+}
+
+int32_t NTP2::clamp32(int64_t v) {
+  if (v > INT32_MAX) return INT32_MAX;
+  if (v < INT32_MIN) return INT32_MIN;
+  return (int32_t)v;
+}
+
+uint32_t NTP2::isqrt(uint64_t v) {
+  uint64_t r = 0;
+  uint64_t bit = 1ULL << 62;
+  while (bit > v) bit >>= 2;
+  while (bit) {
+    if (v >= r + bit) {
+      v -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return r > UINT32_MAX ? UINT32_MAX : (uint32_t)r;
+}
+
+int8_t NTP2::selectPeer() {
+  // Simplified RFC 5905 selection. Each server that answered this cycle
+  // gives a correctness interval of its filtered offset +/- its distance
+  // (delay / 2 + dispersion + jitter). The point covered by the most
+  // intervals marks the majority clique; servers whose interval misses it
+  // are falsetickers. Among the rest, the one with the smallest distance wins.
+  uint8_t candidates = 0;
+  int64_t bestPoint = 0;
+  uint8_t bestCount = 0;
+
+  for (uint8_t i = 0; i < peerCount; i++) {
+    if (!peers[i].fresh) continue;
+    candidates++;
+    int64_t dist = distance(peers[i]);
+    int64_t edges[2] = {peers[i].fOffset - dist, peers[i].fOffset + dist};
+    for (int64_t point : edges) {
+      uint8_t count = 0;
+      for (uint8_t j = 0; j < peerCount; j++) {
+        if (!peers[j].fresh) continue;
+        int64_t d = distance(peers[j]);
+        if (point >= peers[j].fOffset - d && point <= peers[j].fOffset + d) count++;
+      }
+      if (count > bestCount) {
+        bestCount = count;
+        bestPoint = point;
+      }
+    }
+  }
+  if (candidates == 0) return -1;
+
+  // Without a majority there is no way to tell who is wrong; consider everyone
+  bool majority = bestCount * 2 > candidates;
+
+  int8_t best = -1;
+  uint32_t bestDist = UINT32_MAX;
+  for (uint8_t i = 0; i < peerCount; i++) {
+    Peer& p = peers[i];
+    if (!p.fresh) continue;
+    int64_t dist = distance(p);
+    if (majority && (bestPoint < p.fOffset - dist || bestPoint > p.fOffset + dist)) continue;
+    if ((uint32_t)dist < bestDist) {
+      bestDist = (uint32_t)dist;
+      best = i;
+    }
+  }
+  return best;
+}
+
+uint32_t NTP2::distance(const Peer& p) {
+  return p.fDelay / 2 + p.fDisp + p.fJitter;
+}
+
 NTPStatus NTP2::badRead() {
   // A transient bad response must not destroy a previously-good sync. Clocks
   // built on this library extrapolate the current time from ntpTimeSeconds /
@@ -190,77 +1565,600 @@ NTPStatus NTP2::badRead() {
   // Pace the next retry and record the failure status, but keep the prior
   // sync's data intact. ntpStat() now reflects "is there a usable sync"
   // (ntpTimeSeconds > 0), so callers get true across brief outages.
-  activeInterval = retryDelayValue;
+  activeInterval = backoff();
   ntpSt = NTP_BAD_PACKET;
   return ntpSt;
 }
 
-void NTP2::init() {
-  memset(ntpRequest, 0, NTP_PACKET_SIZE);
-  // LI=0, VN=4, Mode=3 (client)
-  ntpRequest[0] = 0b00100011;
+void NTP2::init(Peer& peer, uint8_t index) {
+  // T1: our local clock, written into the Transmit Timestamp field. It is
+  // also the correlation token: the server must copy it into the Originate
+  // Timestamp field of its response. The server index goes in the lowest
+  // fraction bits (well under a nanosecond) so tokens sent within the same
+  // microsecond stay distinct.
+  uint64_t now = monoMicros();
+  peer.reqLocalMicros = (uint32_t)now;
+  peer.reqTx = (localNtpTime(now) & ~0xFFULL) | index;
+}
+
+uint64_t NTP2::localNtpTime(uint64_t nowMicros) {
+  // Once synced our clock is the extrapolated NTP time. Before that it
+  // counts up from NTP_PRESYNC_SECONDS: not a real time, but a valid
+  // timescale for T1/T4 that keeps the first offset within int64 range.
+  if (ntpTimeSeconds == 0) {
+    return ((uint64_t)NTP_PRESYNC_SECONDS << 32) + (uint64_t)microsToNtp((int64_t)nowMicros);
+  }
+  uint64_t elapsed = nowMicros - lastSyncMicros;
+  return ntpAtSync + (uint64_t)microsToNtp((int64_t)elapsed + driftMicros(elapsed) +
+                                           slewPart(slewTotal, slewSpan, elapsed));
+}
 
-  // Request token for request/response correlation.
-  // We write a deterministic 64-bit value into the Transmit Timestamp field.
-  // The server must copy it into the Originate Timestamp field in its response.
-  uint32_t nowMs = millis();
-  reqTxSec  = nowMs;   // token (not an actual NTP seconds value)
-  reqTxFrac = 0;
+int64_t NTP2::driftMicros(uint64_t elapsedUs) {
+  // Correction for our oscillator's measured frequency error
+  return ((int64_t)(elapsedUs / 1000ULL) * freqPpb) / 1000000LL;
+}
 
-  ntpRequest[40] = (reqTxSec >> 24) & 0xFF;
-  ntpRequest[41] = (reqTxSec >> 16) & 0xFF;
-  ntpRequest[42] = (reqTxSec >> 8)  & 0xFF;
-  ntpRequest[43] = (reqTxSec)       & 0xFF;
+int64_t NTP2::slewPart(int32_t total, uint32_t span, uint64_t elapsedUs) {
+  // The share of a slew applied after elapsedUs: linear over the span, so
+  // the clock's rate changes by total / span and nothing else
+  if (elapsedUs >= span) return total;
+  return (int64_t)total * (int64_t)elapsedUs / (int64_t)span;
+}
 
-  ntpRequest[44] = (reqTxFrac >> 24) & 0xFF;
-  ntpRequest[45] = (reqTxFrac >> 16) & 0xFF;
-  ntpRequest[46] = (reqTxFrac >> 8)  & 0xFF;
-  ntpRequest[47] = (reqTxFrac)       & 0xFF;
+int64_t NTP2::slewPending(uint64_t nowMicros) {
+  // What the slew in progress has yet to add to the clock
+  if (ntpTimeSeconds == 0) return 0;
+  return slewTotal - slewPart(slewTotal, slewSpan, nowMicros - lastSyncMicros);
+}
+
+int64_t NTP2::microsToNtp(int64_t us) {
+  int64_t sec = us / 1000000LL;
+  int64_t rem = us % 1000000LL;
+  if (rem < 0) {
+    rem += 1000000LL;
+    sec--;
+  }
+  return sec * 4294967296LL + (int64_t)(((uint64_t)rem << 32) / 1000000ULL);
 }
 
-bool NTP2::checkValid(uint32_t tempTimeSeconds) {
-  if (tempTimeSeconds == 0) return false;
-  
+int64_t NTP2::ntpToMicros(int64_t ntp) {
+  int64_t sec = ntp >> 32;
+  uint64_t frac = (uint64_t)ntp & 0xFFFFFFFFULL;
+  return sec * 1000000LL + (int64_t)((frac * 1000000ULL) >> 32);
+}
+
+uint64_t NTP2::monoMicros() {
+  // micros() wraps every 71.6 minutes. The 64-bit millis base says roughly
+  // how much time has passed since the last call, which pins down how many
+  // wraps happened, however long that was.
+  uint64_t ms = monoMillis();
+  uint32_t us = NTP2_MICROS();
+  uint64_t expect = microsLast + (ms - microsLastMs) * 1000ULL;
+  uint64_t v = (expect & ~0xFFFFFFFFULL) | us;
+  if (v > expect && v - expect > 0x80000000ULL) v -= 0x100000000ULL;
+  else if (expect > v && expect - v > 0x80000000ULL) v += 0x100000000ULL;
+  microsLast = v;
+  microsLastMs = ms;
+  return v;
+}
+
+uint64_t NTP2::monoMillis() {
+  // millis() extended to 64 bits. Every update() passes through here, so
+  // a wrap is seen as long as it runs at least once every 49.7 days.
+  // epoch() and the other readers don't, as they may run on another core:
+  // they add a 32-bit millis() delta to the snapshot update() publishes,
+  // which covers the same 49.7 days since the last update().
+  uint32_t now = NTP2_MILLIS();
+  if (now < monoLow) monoHigh++;
+  monoLow = now;
+  return ((uint64_t)monoHigh << 32) | now;
+}
+
+uint32_t NTP2::be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8)  | (uint32_t)p[3];
+}
+
+bool NTP2::checkValid(const Packet& pkt, uint32_t tempTimeSeconds) {
+  NTPVerdict v = verdict(pkt, tempTimeSeconds);
+#ifdef NTP2_STATS
+  switch (v) {
+    case NTP_PKT_BAD_TIME:    NTP2_COUNT(badTime); break;
+    case NTP_PKT_BAD_LEAP:    NTP2_COUNT(badLeap); break;
+    case NTP_PKT_BAD_VERSION: NTP2_COUNT(badVersion); break;
+    case NTP_PKT_BAD_MODE:    NTP2_COUNT(badMode); break;
+    case NTP_PKT_BAD_STRATUM: NTP2_COUNT(badStratum); break;
+    default:                  break;
+  }
+#endif
+  return v == NTP_PKT_ACCEPT;
+}
+
+NTPVerdict NTP2::verdict(const Packet& pkt, uint32_t tempTimeSeconds) {
+  if (tempTimeSeconds == 0) return NTP_PKT_BAD_TIME;
+
   // Check Leap Indicator (bits 7-6): reject if 3 (alarm/unsynchronized)
-  uint8_t li = (ntpQuery[0] & 0xC0) >> 6;
-  if (li == 3) return false;
-  
-  uint8_t version = (ntpQuery[0] & 0x38) >> 3;
-  if (version < 3 || version > 4) return false;
-  
-  uint8_t mode = ntpQuery[0] & 0x07;
-  if (mode != 4 && mode != 5) return false;
-  
-  uint8_t stratum = ntpQuery[1];
+  uint8_t li = (pkt.flags & 0xC0) >> 6;
+  if (li == 3) return NTP_PKT_BAD_LEAP;
+
+  uint8_t version = (pkt.flags & 0x38) >> 3;
+  if (version < 3 || version > 4) return NTP_PKT_BAD_VERSION;
+
+  uint8_t mode = pkt.flags & 0x07;
+  if (mode != 4 && mode != 5) return NTP_PKT_BAD_MODE;
+
+  uint8_t stratum = pkt.stratum;
   // Reject stratum 0 (already handled as KoD) and stratum 16 (unsynchronized)
-  return (stratum >= 1 && stratum <= 15);
+  if (stratum < 1 || stratum > 15) return NTP_PKT_BAD_STRATUM;
+  return NTP_PKT_ACCEPT;
 }
 
-time_t NTP2::epoch() {
-  if (ntpTimeSeconds == 0 || lastSyncMillis == 0) return 0;
-  
-  // Calculate elapsed time using proper signed arithmetic for millis() wraparound
-  uint32_t now = millis();
-  int32_t elapsedMs = (int32_t)(now - lastSyncMillis);
-  if (elapsedMs < 0) elapsedMs = 0;
-  
-  // Use the stored high-precision timestamp and add elapsed time
-  // This preserves fractional seconds from the NTP response
-  uint64_t currentNtpMillis = ntpMillisAtSync + (uint32_t)elapsedMs;
-  
-  // Convert to Unix epoch (seconds since Jan 1, 1970)
-  // NTP epoch is Jan 1, 1900, so subtract 70 years in seconds
-  time_t unixNow = (time_t)((currentNtpMillis / 1000ULL) - SEVENTYYEARS);
+NTPVerdict NTP2::classify(const uint8_t* buf, size_t len, NTPStatus* kod) {
+  // The receive path's decisions in the order it takes them, minus the
+  // ones that need a request in flight (token match, stale replies).
+  // Anything past the 48-byte header, extension fields or an NTS MAC, is
+  // ignored there too.
+  if (!buf || len < NTP_PACKET_SIZE) return NTP_PKT_UNDERSIZED;
+  Packet pkt;
+  unpack(buf, pkt);
+  uint8_t mode = pkt.flags & 0x07;
+  if (mode == 3) return NTP_PKT_REQUEST;
+  if (pkt.stratum == 0 && (mode == 4 || mode == 5)) {
+#ifndef NTP2_NO_KOD
+    if (kod) *kod = classifyKod(pkt.refId);
+#else
+    if (kod) *kod = NTP_UNKNOWN_KOD;
+#endif
+    return NTP_PKT_KOD;
+  }
+  return verdict(pkt, (uint32_t)(pkt.tx >> 32));
+}
+
+void NTP2::publishSnapshot(bool step) {
+  // Everything a reader needs to extrapolate the time without touching
+  // the rest of our state: the clock at an anchor point, the rate, and
+  // the Unix second precomputed for epoch()
+  Snapshot next;
+  uint32_t ms = NTP2_MILLIS();
+  uint64_t us = monoMicros();
+  uint64_t now = localNtpTime(us);
+  next.ntp = now;
+  next.micros = (uint32_t)us;
+  next.millis = ms;
+  next.freqPpb = freqPpb;
+#ifndef NTP2_NO_SLEW
+  // The rest of the slew in progress, carried on from this anchor
+  uint64_t sinceSync = us - lastSyncMicros;
+  next.slewLeft = (int32_t)(slewTotal - slewPart(slewTotal, slewSpan, sinceSync));
+  next.slewSpan = sinceSync >= slewSpan ? 0 : slewSpan - (uint32_t)sinceSync;
+#endif
+  next.epochSec = 0;
+  next.epochSecMillis = ms;
 
   // Plausibility guard: reject obviously-wrong epochs.
   // Adjust these bounds if you need to support earlier dates.
-  const time_t MIN_OK = 946684800UL;   // 2000-01-01
-  const time_t MAX_OK = 4102444800UL;  // 2100-01-01
-  if (unixNow < MIN_OK || unixNow > MAX_OK) return 0;
+  const uint64_t MIN_OK = 946684800ULL + SEVENTYYEARS;   // 2000-01-01
+  const uint64_t MAX_OK = 4102444800ULL + SEVENTYYEARS;  // 2100-01-01
+  uint64_t sec = now >> 32;
+  if (ntpTimeSeconds != 0 && sec >= MIN_OK && sec <= MAX_OK) {
+    // Convert to Unix epoch (seconds since Jan 1, 1970)
+    // NTP epoch is Jan 1, 1900, so subtract 70 years in seconds
+    next.epochSec = (uint32_t)(sec - SEVENTYYEARS);
+    next.epochSecMillis = ms - (uint32_t)(((now & 0xFFFFFFFFULL) * 1000ULL) >> 32);
+    // A slow slew moves the second boundary earlier; rather than show the
+    // previous second again, hold the current one a little longer
+    if (slewThreshold != 0 && !step && snap[0].epochSec != 0) {
+      uint32_t shown = snap[0].epochSec + (ms - snap[0].epochSecMillis) / 1000;
+      if ((int32_t)(next.epochSec - shown) < 0) {
+        next.epochSec = shown;
+        next.epochSecMillis = ms;
+      }
+    }
+  }
+  writeSnapshot(next);
+}
+
+void NTP2::writeSnapshot(const Snapshot& next) {
+  // Seqlock with two copies: readers use the copy the counter's low bit
+  // points at, which is never the one being written. A reader interrupting
+  // the writer on the same core therefore still completes, and one racing
+  // it from another core retries at most once per write. On AVR the only
+  // reader that can run during the write is an ISR, so masking interrupts
+  // for the copy does the same with one copy.
+#if defined(__AVR__)
+  uint8_t sreg = SREG;
+  cli();
+  snap[0] = next;
+  NTP2_BARRIER();
+  SREG = sreg;
+#else
+  snapSeq++;
+  NTP2_BARRIER();
+  snap[0] = next;
+  NTP2_BARRIER();
+  snapSeq++;
+  NTP2_BARRIER();
+  snap[1] = next;
+#endif
+}
+
+void NTP2::readSnapshot(Snapshot& out) {
+#if defined(__AVR__)
+  out = snap[0];
+#else
+  uint8_t seq;
+  do {
+    seq = snapSeq;
+    NTP2_BARRIER();
+    out = snap[seq & 1];
+    NTP2_BARRIER();
+  } while (seq != snapSeq);
+#endif
+}
+
+void NTP2::readSeconds(uint32_t& sec, uint32_t& secMillis) {
+  // readSnapshot() for just the two words epoch() needs, so the fast path
+  // doesn't pay for a copy of the whole snapshot
+#if defined(__AVR__)
+  sec = snap[0].epochSec;
+  secMillis = snap[0].epochSecMillis;
+#else
+  uint8_t seq;
+  do {
+    seq = snapSeq;
+    NTP2_BARRIER();
+    const Snapshot& s = snap[seq & 1];
+    sec = s.epochSec;
+    secMillis = s.epochSecMillis;
+    NTP2_BARRIER();
+  } while (seq != snapSeq);
+#endif
+}
 
-  return unixNow;
+uint64_t NTP2::ntpTime() {
+  Snapshot s;
+  readSnapshot(s);
+  if (s.epochSec == 0) return 0;
+
+  // Readers may run on another core or in an ISR, so extrapolate from the
+  // snapshot alone. micros() covers 71 minutes past the anchor and update()
+  // rebases well within that; beyond it fall back to millis().
+  uint32_t elapsedMs = NTP2_MILLIS() - s.millis;
+  uint64_t elapsed = elapsedMs < 3600000UL
+                       ? (uint64_t)(uint32_t)(NTP2_MICROS() - s.micros)
+                       : (uint64_t)elapsedMs * 1000ULL;
+  int64_t drift = ((int64_t)(elapsed / 1000ULL) * s.freqPpb) / 1000000LL;
+#ifndef NTP2_NO_SLEW
+  drift += slewPart(s.slewLeft, s.slewSpan, elapsed);
+#endif
+  return s.ntp + (uint64_t)microsToNtp((int64_t)elapsed + drift);
+}
+
+time_t NTP2::epoch() {
+  uint32_t sec, secMillis;
+  readSeconds(sec, secMillis);
+  if (sec == 0) return 0;
+
+  // Fast path: a 32-bit subtract and compare. update() rolls the second
+  // over, so the divide only runs if it hasn't been called for a while.
+  uint32_t elapsed = NTP2_MILLIS() - secMillis;
+  if (elapsed < 1000) return (time_t)sec;
+  if (elapsed < 2000) return (time_t)(sec + 1);
+  return (time_t)(sec + elapsed / 1000);
+}
+
+uint32_t NTP2::millisToNextSecond() {
+  // From the same snapshot epoch() counts seconds with, so the callback
+  // and epoch() roll over together; 1000 until there is a valid time
+  uint32_t sec, secMillis;
+  readSeconds(sec, secMillis);
+  if (sec == 0) return 1000;
+  return 1000 - (NTP2_MILLIS() - secMillis) % 1000;
 }
 
+uint32_t NTP2::microsToNextSecond() {
+  uint64_t now = ntpTime();
+  if (now == 0) return 1000000;
+  return 1000000 - (uint32_t)(((now & 0xFFFFFFFFULL) * 1000000ULL) >> 32);
+}
+
+void NTP2::onSecond(NTPSecondHandler fn) {
+  secondFn = fn;
+  secondFired = epoch();
+}
+
+void NTP2::fireSecond() {
+  // Once per second, however often update() runs. After a gap (or a step)
+  // it fires once for the current second rather than catching up.
+  time_t now = epoch();
+  if (now == 0 || now == secondFired) return;
+  secondFired = now;
+  secondFn(now);
+}
+
+#ifdef NTP2_PPS
+bool NTP2::pps(int8_t pin, uint16_t widthMs) {
+  if (ppsTimer) {
+    esp_timer_stop((esp_timer_handle_t)ppsTimer);
+    esp_timer_delete((esp_timer_handle_t)ppsTimer);
+    ppsTimer = nullptr;
+    if (ppsPin >= 0) digitalWrite(ppsPin, LOW);
+  }
+  ppsPin = pin;
+  if (pin < 0) return true;
+  if (widthMs == 0 || widthMs >= 1000) widthMs = NTP_PPS_WIDTH;
+  ppsWidth = widthMs;
+  ppsHigh = false;
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, LOW);
+
+  esp_timer_create_args_t args = {};
+  args.callback = ppsTick;
+  args.arg = this;
+  args.name = "ntp2pps";
+  esp_timer_handle_t handle;
+  if (esp_timer_create(&args, &handle) != ESP_OK) {
+    ppsPin = -1;
+    return false;
+  }
+  ppsTimer = handle;
+  esp_timer_start_once(handle, microsToNextSecond());
+  return true;
+}
+
+void NTP2::ppsTick(void* arg) {
+  // Runs in the esp_timer task. The rising edge is aimed at the second
+  // boundary on the lock-free ntpTime() path; the falling edge ends the
+  // pulse and aims at the next boundary. No pulse without a valid time.
+  NTP2* self = static_cast<NTP2*>(arg);
+  esp_timer_handle_t timer = (esp_timer_handle_t)self->ppsTimer;
+  if (!timer) return;
+  if (self->ppsHigh) {
+    digitalWrite(self->ppsPin, LOW);
+    self->ppsHigh = false;
+    esp_timer_start_once(timer, self->microsToNextSecond());
+    return;
+  }
+  // On time is within 50 us before the boundary or 200 us after it. Waking
+  // anywhere else (the clock was corrected or first set since arming)
+  // re-aims at the next one.
+  uint32_t left = self->microsToNextSecond();
+  if (self->ntpTime() != 0 && left > 50 && left < 999800) {
+    esp_timer_start_once(timer, left);
+    return;
+  }
+  if (self->ntpTime() != 0) {
+    digitalWrite(self->ppsPin, HIGH);
+    self->ppsHigh = true;
+    esp_timer_start_once(timer, (uint64_t)self->ppsWidth * 1000ULL);
+    return;
+  }
+  esp_timer_start_once(timer, 1000000);
+}
+#endif
+
+#ifndef NTP2_NO_CALENDAR
+bool NTP2::nowSeconds(uint32_t& sec, uint16_t& ms) {
+  // epoch() with its millisecond, from one snapshot read
+  uint32_t secMillis;
+  readSeconds(sec, secMillis);
+  if (sec == 0) return false;
+  uint32_t elapsed = NTP2_MILLIS() - secMillis;
+  if (elapsed >= 2000) {
+    sec += elapsed / 1000;
+    elapsed %= 1000;
+  } else if (elapsed >= 1000) {
+    sec++;
+    elapsed -= 1000;
+  }
+  ms = (uint16_t)elapsed;
+  return true;
+}
+
+bool NTP2::utc(NTPDateTime& t) {
+  uint32_t sec;
+  uint16_t ms;
+  if (!nowSeconds(sec, ms)) return false;
+  breakDown(sec, ms, utcDay, t);
+  return true;
+}
+
+bool NTP2::local(NTPDateTime& t) {
+  uint32_t sec;
+  uint16_t ms;
+  if (!nowSeconds(sec, ms)) return false;
+  if (dstFn && (int32_t)(sec - dstUntil) >= 0) {
+    // Rules change on the hour; ask again at the next one
+    dstMinutes = dstFn((time_t)sec);
+    dstUntil = sec - sec % 3600 + 3600;
+  }
+  int32_t shift = ((int32_t)tzOffset + (dstFn ? dstMinutes : 0)) * 60L;
+  breakDown(sec + (uint32_t)shift, ms, localDay, t);
+  return true;
+}
+
+void NTP2::timeZone(int16_t offsetMinutes, NTPDstRule dst) {
+  tzOffset = offsetMinutes;
+  dstFn = dst;
+  dstMinutes = 0;
+  dstUntil = 0;
+  localDay.start = 0;
+}
+
+void NTP2::breakDown(uint32_t sec, uint16_t ms, DayCache& cache, NTPDateTime& t) {
+  // Within the cached day only the time of day is worked out, a divide by
+  // 60 and a 16-bit one; the date is recomputed at most once a day
+  uint32_t sod = sec - cache.start;
+  if (cache.start == 0 || sod >= 86400UL) {
+    // Civil date from days since 1970-01-01 (H. Hinnant's algorithm,
+    // shifted so years start in March and leap days fall last)
+    uint32_t days = sec / 86400UL;
+    cache.start = days * 86400UL;
+    sod = sec - cache.start;
+    cache.weekday = (uint8_t)((days + 4) % 7);  // 1970-01-01 was a Thursday
+    uint32_t z = days + 719468UL;
+    uint32_t era = z / 146097UL;
+    uint32_t doe = z - era * 146097UL;
+    uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    uint32_t mp = (5 * doy + 2) / 153;
+    cache.day = (uint8_t)(doy - (153 * mp + 2) / 5 + 1);
+    cache.month = (uint8_t)(mp < 10 ? mp + 3 : mp - 9);
+    cache.year = (uint16_t)(yoe + era * 400 + (cache.month <= 2 ? 1 : 0));
+  }
+  t.year = cache.year;
+  t.month = cache.month;
+  t.day = cache.day;
+  t.weekday = cache.weekday;
+  uint16_t minutes = (uint16_t)(sod / 60);
+  t.second = (uint8_t)(sod - minutes * 60UL);
+  t.hour = (uint8_t)(minutes / 60);
+  t.minute = (uint8_t)(minutes - t.hour * 60);
+  t.millis = ms;
+}
+
+#endif
+
+uint64_t NTP2::epochMillis() {
+  uint64_t now = ntpTime();
+  if (now == 0) return 0;
+  return (uint64_t)((now >> 32) - SEVENTYYEARS) * 1000ULL +
+         (((now & 0xFFFFFFFFULL) * 1000ULL) >> 32);
+}
+
+uint64_t NTP2::epochMicros() {
+  uint64_t now = ntpTime();
+  if (now == 0) return 0;
+  return (uint64_t)((now >> 32) - SEVENTYYEARS) * 1000000ULL +
+         (((now & 0xFFFFFFFFULL) * 1000000ULL) >> 32);
+}
+
+int32_t NTP2::frequency() {
+  return freqPpb;
+}
+
+int32_t NTP2::offset() {
+  return offsetMs;
+}
+
+uint32_t NTP2::roundTripDelay() {
+  return delayMs;
+}
+
+uint32_t NTP2::jitter() {
+  return syncPeer >= 0 ? peers[syncPeer].fJitter / 1000 : 0;
+}
+
+int8_t NTP2::syncServer() {
+  return syncPeer;
+}
+
+uint16_t NTP2::serverScore(uint8_t index) {
+  return index < peerCount ? score(peers[index], NTP2_MILLIS()) : 0xFFFF;
+}
+
+uint16_t NTP2::score(Peer& p, uint32_t now) {
+  // Lower is better; 0xFFFF marks a demoted server. Misses over the last
+  // eight polls (KoDs included) dominate, then round-trip delay in ms,
+  // then stratum. A server never heard from counts as eight misses at
+  // stratum 16, so the configured order decides until replies come in.
+  if (p.demoted) {
+    if ((int32_t)(now - p.demotedUntil) < 0) return 0xFFFF;
+    p.demoted = false;
+  }
+  uint8_t misses = 8;
+  for (uint8_t r = p.reach; r; r &= r - 1) misses--;
+  uint32_t rttMs = p.filterCount ? p.fDelay / 1000 : 1000;
+  uint32_t total = misses * NTP_SCORE_MISS + (rttMs < 1000 ? rttMs : 1000) +
+                   (p.stratum ? p.stratum : 16) * NTP_SCORE_STRATUM;
+  return total < 0xFFFF ? total : 0xFFFE;
+}
+
+int8_t NTP2::rankedPeer(uint32_t now) {
+  // Best-scored server not yet tried this round; ties go to the earlier one
+  int8_t best = -1;
+  uint16_t bestScore = 0xFFFF;
+  for (uint8_t i = 0; i < peerCount; i++) {
+    if (peers[i].tried) continue;
+    uint16_t sc = score(peers[i], now);
+    if (sc < bestScore) {
+      best = i;
+      bestScore = sc;
+    }
+  }
+  return best;
+}
+
+#ifndef NTP2_NO_KOD
+NTPStatus NTP2::classifyKod(uint32_t refId) {
+  // The reference ID as a big-endian word; the compiler turns this into a
+  // compare tree, no strings involved
+  switch (refId) {
+    case kodCode("RATE"): return NTP_KOD_RATE;
+    case kodCode("DENY"): return NTP_KOD_DENY;
+    case kodCode("ACST"): return NTP_KOD_ACST;
+    case kodCode("AUTH"): return NTP_KOD_AUTH;
+    case kodCode("AUTO"): return NTP_KOD_AUTO;
+    case kodCode("BCST"): return NTP_KOD_BCST;
+    case kodCode("CRYP"): return NTP_KOD_CRYP;
+    case kodCode("DROP"): return NTP_KOD_DROP;
+    case kodCode("RSTR"): return NTP_KOD_RSTR;
+    case kodCode("INIT"): return NTP_KOD_INIT;
+    case kodCode("MCST"): return NTP_KOD_MCST;
+    case kodCode("NKEY"): return NTP_KOD_NKEY;
+    case kodCode("NTSN"): return NTP_KOD_NTSN;
+    case kodCode("RMOT"): return NTP_KOD_RMOT;
+    case kodCode("STEP"): return NTP_KOD_STEP;
+    default:              return NTP_UNKNOWN_KOD;
+  }
+}
+
+uint16_t NTP2::kodCount(NTPStatus code) {
+  if (code < NTP_KOD_RATE || code > NTP_UNKNOWN_KOD || code == NTP_KOD_STEP + 1) return 0;
+  return kodCounts[code - NTP_KOD_RATE];
+}
+
+uint16_t NTP2::serverKodCount(uint8_t index) {
+  return index < peerCount ? peers[index].kodCount : 0;
+}
+
+NTPStatus NTP2::serverKod(uint8_t index) {
+  return index < peerCount ? peers[index].lastKod : NTP_IDLE;
+}
+
+void NTP2::resetKodCounts() {
+  memset(kodCounts, 0, sizeof(kodCounts));
+  for (uint8_t i = 0; i < peerCount; i++) {
+    peers[i].kodCount = 0;
+    peers[i].lastKod = NTP_IDLE;
+  }
+}
+#endif
+
+#ifdef NTP2_STATS
+NTP2::Stats NTP2::stats() {
+  Stats out = st;
+  out.rttAvg = st.replies ? (uint32_t)(rttSum / st.replies) : 0;
+  if (!st.replies) out.rttMin = 0;
+#ifndef NTP2_NO_KOD
+  memcpy(out.kod, kodCounts, sizeof(out.kod));
+#endif
+  if (syncPeer >= 0) {
+    out.lastOffset = peers[syncPeer].fOffset;
+    out.lastJitter = peers[syncPeer].fJitter;
+  }
+  return out;
+}
+
+void NTP2::resetStats() {
+  st = Stats();
+  rttSum = 0;
+#ifndef NTP2_NO_KOD
+  resetKodCounts();
+#endif
+}
+#endif
+
 uint32_t NTP2::timestamp() {
   return lastResponseMillis;
 }
@@ -271,5 +2169,296 @@ bool NTP2::ntpStat() {
   // pairing this with epoch() get a continuously-advancing clock; callers
   // wanting current-packet status should check the return of update() /
   // forceUpdate() instead.
-  return (ntpTimeSeconds > 0 && lastSyncMillis > 0);
-}
\ No newline at end of file
+  return ntpTimeSeconds > 0;
+}
+
+#ifndef NTP2_NO_LISTEN
+void NTP2::listen(bool enable, IPAddress group, bool calibrate) {
+  // Call before begin(); the socket joins the group when it opens
+  if (requestTimestamp != 0) return;
+  listening = enable;
+  listenGroup = enable ? (uint32_t)group : 0;
+  calibrating = enable && calibrate;
+  bcastDelayUs = NTP_BCAST_DELAY;
+}
+#endif
+
+#ifndef NTP2_NO_SERVE
+void NTP2::serve(bool enable, uint32_t minGap, bool sendKod) {
+  serving = enable;
+  serveMinGap = minGap;
+  serveKod = sendKod;
+  memset(clients, 0, sizeof(clients));
+}
+
+void NTP2::serveRequest(const Packet& req, uint32_t rxMicros, IPAddress ip, uint16_t port) {
+  // Only a confirmed clock is worth passing on
+  if (!serving || syncPeer < 0 || provisional) return;
+  Peer& up = peers[syncPeer];
+
+  // Rate limit per client: requests closer together than the minimum gap
+  // get one RATE KoD, then are dropped until the client slows down
+  uint32_t now = NTP2_MILLIS();
+  uint32_t addr = (uint32_t)ip;
+  Client* c = &clients[0];
+  for (auto& k : clients) {
+    if (k.ip == addr) {
+      c = &k;
+      break;
+    }
+    if (now - k.lastMillis > now - c->lastMillis) c = &k;  // least recently seen
+  }
+  bool known = c->ip == addr;
+  bool tooSoon = known && now - c->lastMillis < serveMinGap;
+  c->ip = addr;
+  c->lastMillis = now;
+  if (tooSoon) {
+    NTP2_COUNT(rateLimited);
+    // Saturates, so a client that never slows down isn't sent a fresh KoD
+    // every 256 strikes
+    bool kissed = c->strikes > 0;
+    if (c->strikes < 0xFF) c->strikes++;
+    if (kissed || !serveKod) return;
+  } else {
+    c->strikes = 0;
+  }
+
+  // T2 from the arrival time, on our disciplined clock
+  uint64_t nowMicros = monoMicros();
+  uint64_t rx = localNtpTime(nowMicros) - (uint64_t)microsToNtp((uint32_t)nowMicros - rxMicros);
+
+  uint8_t out[NTP_PACKET_SIZE];
+  memset(out, 0, sizeof(out));
+  uint8_t version = req.flags & 0x38;
+  if (tooSoon) {
+    // Kiss-o'-Death: LI=3, stratum 0, code in the reference ID
+    out[0] = 0xC0 | version | 4;
+    put32(&out[12], kodCode("RATE"));
+  } else {
+    // Our error bounds are upstream's plus our path to it, growing at
+    // 15 ppm since the last sync
+    uint32_t age = (uint32_t)((nowMicros - lastSyncMicros) / 1000000ULL);
+    uint32_t dispUs = up.fDisp + up.fJitter + age * 15UL;
+    // A stratum-15 upstream would make us 16: unsynchronised, which is
+    // said with leap 3, so clients don't take our time
+    bool unsynced = up.stratum >= 15;
+    out[0] = ((unsynced ? 3 : up.leap) << 6) | version | 4;
+    out[1] = unsynced ? 16 : up.stratum + 1;
+    put32(&out[4], up.rootDelay + (uint32_t)(((uint64_t)up.fDelay << 16) / 1000000ULL));
+    put32(&out[8], up.rootDisp + (uint32_t)(((uint64_t)dispUs << 16) / 1000000ULL));
+    out[12] = up.ip[0];
+    out[13] = up.ip[1];
+    out[14] = up.ip[2];
+    out[15] = up.ip[3];
+    put32(&out[16], (uint32_t)(ntpAtSync >> 32));    // Reference
+    put32(&out[20], (uint32_t)ntpAtSync);
+  }
+  out[2] = req.poll;
+  out[3] = (uint8_t)-20;                             // precision ~1 us
+
+  put32(&out[24], (uint32_t)(req.tx >> 32));         // Originate
+  put32(&out[28], (uint32_t)req.tx);
+  put32(&out[32], (uint32_t)(rx >> 32));             // Receive
+  put32(&out[36], (uint32_t)rx);
+  // Transmit, stamped as late as possible
+  uint64_t tx = localNtpTime(monoMicros());
+  put32(&out[40], (uint32_t)(tx >> 32));
+  put32(&out[44], (uint32_t)tx);
+
+#ifdef NTP2_LWIP_UDP
+  if (!udp) {
+    if (rawSend(out, ip, port)) NTP2_COUNT(served);
+    return;
+  }
+#endif
+  if (udp->beginPacket(ip, port) && udp->write(out, NTP_PACKET_SIZE) == NTP_PACKET_SIZE && udp->endPacket()) {
+    NTP2_COUNT(served);
+  }
+}
+
+#endif
+
+#ifdef NTP2_TASK
+bool NTP2::beginTask(uint32_t stackSize, uint8_t priority, int8_t core) {
+  // Call after begin(); the task then runs update() by itself and the
+  // sketch only reads the time. Configure everything else beforehand. A
+  // shared socket is driven from the sketch, so it can't be handed over.
+  if (taskHandle || dispatcher) return false;
+  taskStop = false;
+  TaskHandle_t handle = nullptr;
+#if defined(ESP32)
+  BaseType_t ok = xTaskCreatePinnedToCore(taskEntry, "ntp2", stackSize, this, priority, &handle,
+                                          core < 0 ? tskNO_AFFINITY : core);
+#else
+  // Vanilla FreeRTOS sizes stacks in words
+  BaseType_t ok = xTaskCreate(taskEntry, "ntp2", stackSize / sizeof(StackType_t), this, priority, &handle);
+#if configUSE_CORE_AFFINITY
+  if (ok == pdPASS && core >= 0) vTaskCoreAffinitySet(handle, 1 << core);
+#endif
+#endif
+  if (ok != pdPASS) return false;
+  taskHandle = handle;
+  return true;
+}
+
+void NTP2::stopTask() {
+  if (!taskHandle || inTask()) return;
+  taskStop = true;
+  xTaskNotifyGive((TaskHandle_t)taskHandle);
+  // The task finishes its current update() and clears the handle on exit
+  while (taskHandle) vTaskDelay(1);
+}
+
+void NTP2::taskEntry(void* arg) {
+  static_cast<NTP2*>(arg)->taskLoop();
+}
+
+void NTP2::taskLoop() {
+  // Wait for taskHandle to be published by beginTask()
+  while (!taskHandle) vTaskDelay(1);
+
+  while (!taskStop) {
+    uint8_t req = __atomic_exchange_n(&taskRequest, 0, __ATOMIC_SEQ_CST);
+    if (req && requestTimestamp == 0) {
+      if (req & NTP2_TASK_BURST) startBurst();
+      force = true;
+    } else if (req) {
+      // A poll is already in flight; take the request after it
+      __atomic_or_fetch(&taskRequest, req, __ATOMIC_SEQ_CST);
+    }
+    update();
+    // Sleep until something is due, or until forceUpdate()/stopTask()
+    // notifies us
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(taskWait()) + 1);
+  }
+
+#ifdef NTP2_LWIP_UDP
+  // rawRecv() notifies the task from the lwIP thread; clearing the handle
+  // there too means it can't be caught between its check and the notify
+  // once the task is gone
+  if (pcb) {
+    ntp2LwipCall([](void* arg) {
+      static_cast<NTP2*>(arg)->taskHandle = nullptr;
+    }, this);
+  }
+#endif
+  taskHandle = nullptr;
+  vTaskDelete(nullptr);
+}
+
+uint32_t NTP2::taskWait() {
+  // Wake at least each second to roll the epoch() snapshot over
+  uint32_t wait = nextWakeMillis();
+  return wait > 1000 ? 1000 : wait;
+}
+
+bool NTP2::inTask() {
+  return xTaskGetCurrentTaskHandle() == (TaskHandle_t)taskHandle;
+}
+#endif
+
+NTP2Dispatcher::NTP2Dispatcher(UDP& udp) {
+  this->udp = &udp;
+}
+
+uint16_t NTP2Dispatcher::begin(uint16_t localPort) {
+  // Port 0 picks an ephemeral one, so a fixed port 123 isn't tied up;
+  // replies come back to whatever port the requests went out from
+  for (uint8_t tries = 0; tries < 4; tries++) {
+    uint16_t p = localPort;
+    if (p == 0) {
+      uint32_t seed = NTP2_MICROS() ^ (NTP2_MILLIS() << 7) ^ ((uint32_t)tries * 0x9E3779B9UL);
+      p = NTP_EPHEMERAL_MIN + (uint16_t)(seed % NTP_EPHEMERAL_COUNT);
+    }
+    if (udp->begin(p)) {
+      port = p;
+      return port;
+    }
+    if (localPort != 0) break;
+  }
+  port = 0;
+  return 0;
+}
+
+void NTP2Dispatcher::stop() {
+  udp->stop();
+  port = 0;
+}
+
+bool NTP2Dispatcher::attach(NTP2& client) {
+  // Before client.begin(); the client then sends on our socket and never
+  // reads it. Raw lwIP clients have their own pcb and can't share.
+  if (!client.udp || client.dispatcher || clientCount >= NTP_DISPATCH_CLIENTS) return false;
+  client.ownUdp = client.udp;
+  client.udp = udp;
+  client.dispatcher = this;
+  clients[clientCount++] = &client;
+  return true;
+}
+
+void NTP2Dispatcher::detach(NTP2& client) {
+  for (uint8_t i = 0; i < clientCount; i++) {
+    if (clients[i] != &client) continue;
+    clients[i] = clients[--clientCount];
+    // Back on its own socket, which its next begin() opens; the shared
+    // one stays with the remaining clients
+    client.udp = client.ownUdp;
+    client.ownUdp = nullptr;
+    client.dispatcher = nullptr;
+    return;
+  }
+}
+
+uint16_t NTP2Dispatcher::localPort() {
+  return port;
+}
+
+int NTP2Dispatcher::update() {
+  // NTP packets are read and given to the client they belong to. The
+  // first packet that isn't NTP stops the loop and its size is returned,
+  // unread; the caller reads it from the UDP object as usual before
+  // calling again. Returns 0 once nothing is left (or after a batch).
+  int packetSize;
+  for (uint8_t n = 0; n < NTP_SERVE_BATCH && (packetSize = udp->parsePacket()) > 0; n++) {
+    uint32_t rxMicros = NTP2_MICROS();
+    uint32_t rxMillis = NTP2_MILLIS();
+    IPAddress ip = udp->remoteIP();
+    uint16_t remote = udp->remotePort();
+    if (port != NTP_PORT && remote != NTP_PORT) return packetSize;
+
+    if (packetSize < NTP_PACKET_SIZE) {
+      while (udp->available()) udp->read();
+      continue;
+    }
+    uint8_t hdr[NTP_PACKET_SIZE];
+    udp->read(hdr, NTP_PACKET_SIZE);
+    while (udp->available()) udp->read();
+    NTP2::Packet pkt;
+    NTP2::unpack(hdr, pkt);
+
+    // A broadcast is for every listener; anything else for the one client
+    // that claims it most strongly
+    if ((pkt.flags & 0x07) == 5) {
+      for (uint8_t i = 0; i < clientCount; i++) {
+        if (clients[i]->claim(pkt, ip)) clients[i]->handlePacket(pkt, rxMicros, rxMillis, ip, remote);
+      }
+      continue;
+    }
+    NTP2* client = route(pkt, ip);
+    if (client) client->handlePacket(pkt, rxMicros, rxMillis, ip, remote);
+  }
+  return 0;
+}
+
+NTP2* NTP2Dispatcher::route(const NTP2::Packet& pkt, IPAddress ip) {
+  NTP2* best = nullptr;
+  uint8_t bestScore = 0;
+  for (uint8_t i = 0; i < clientCount; i++) {
+    uint8_t score = clients[i]->claim(pkt, ip);
+    if (score > bestScore) {
+      bestScore = score;
+      best = clients[i];
+    }
+  }
+  return best;
+}
@@ -13,14 +13,198 @@
 typedef unsigned long time_t;
 #endif
 
+// Time sources. A host build can point these at a virtual clock to drive
+// the library off-device; on Arduino they are the core's counters.
+#ifndef NTP2_MILLIS
+#define NTP2_MILLIS() millis()
+#endif
+#ifndef NTP2_MICROS
+#define NTP2_MICROS() micros()
+#endif
+
+// Build-time feature selection. Each feature left out costs no flash or
+// RAM, and its API goes with it. NTP2_NO_KOD honors a KoD (the poll backs
+// off) but reports every code as NTP_UNKNOWN_KOD and counts none;
+// NTP2_NO_SERVE drops server mode and its client table; NTP2_NO_SLEW,
+// NTP2_NO_LISTEN and NTP2_NO_CALENDAR drop slew(), listen() and
+// utc()/local() with their state. NTP2_MINIMAL is the smallest client:
+// one server, no filter history, and none of those nor statistics. Set
+// these as build flags so the library and the sketch agree; NTP2Features
+// reports what was built.
+#ifdef NTP2_MINIMAL
+#ifndef NTP_MAX_SERVERS
+#define NTP_MAX_SERVERS    1
+#endif
+#ifndef NTP_FILTER_SIZE
+#define NTP_FILTER_SIZE    1
+#endif
+#ifndef NTP2_NO_STATS
+#define NTP2_NO_STATS
+#endif
+#ifndef NTP2_NO_KOD
+#define NTP2_NO_KOD
+#endif
+#ifndef NTP2_NO_SERVE
+#define NTP2_NO_SERVE
+#endif
+#ifndef NTP2_NO_SLEW
+#define NTP2_NO_SLEW
+#endif
+#ifndef NTP2_NO_LISTEN
+#define NTP2_NO_LISTEN
+#endif
+#ifndef NTP2_NO_CALENDAR
+#define NTP2_NO_CALENDAR
+#endif
+#endif
+
 #define SEVENTYYEARS       2208988800UL
 #define NTP_SERVER         "time.google.com"
 #define NTP_PACKET_SIZE    48
 #define NTP_PORT           123
-#define NTP_RESPONSE_DELAY 250
+#define NTP_RESPONSE_DELAY 1000
 #define NTP_RETRY_DELAY    30000
+// How often the socket needs checking while a request is in flight (ms);
+// what nextWakeMillis() reports then
+#define NTP_RX_POLL        2
 #define NTP_POLL_INTERVAL  3600000
 
+// Where the local clock starts counting before the first sync (2025-01-01
+// in NTP seconds); any value near the present keeps the first offset small
+#define NTP_PRESYNC_SECONDS 3944678400UL
+
+// How often update() re-anchors the published clock snapshot, picking up
+// drift correction (ms)
+#define NTP_EPOCH_REBASE   10000
+
+// Fleet jitter (pollJitter()): how far each poll interval is randomized
+// (+/- percent), and the window the first request after begin() is
+// spread over (ms)
+#define NTP_POLL_JITTER    10
+#define NTP_STARTUP_JITTER 30000
+
+// Server health (failover(), serverScore()): how long a server is left out
+// of polls after a DENY or RSTR KoD (ms), the score added per missed poll
+// of the last 8 and per stratum level, and how many polls a server left
+// out by failover sits through before one of its misses is forgiven
+#define NTP_DEMOTE_DENY    86400000UL
+#define NTP_SCORE_MISS     100
+#define NTP_SCORE_STRATUM  10
+#define NTP_FAILOVER_AGE   8
+
+// Slewing (slew()): corrections smaller than the threshold (ms) are worked
+// off over the window (ms) by running the clock slightly fast or slow;
+// larger ones step it
+#define NTP_SLEW_THRESHOLD 128
+#define NTP_SLEW_WINDOW    60000
+
+// iburst: requests sent back to back at startup, their spacing, and the
+// round-trip delay (ms) good enough to end the burst early
+#define NTP_BURST_COUNT      6
+#define NTP_BURST_SPACING    1500
+#define NTP_BURST_GOOD_DELAY 50
+
+// DNS cache lifetime for hostname servers, and the number of silent polls
+// after which a cached address is looked up again early
+#define NTP_DNS_TTL        3600000
+#define NTP_DNS_MAX_FAILS  3
+
+// On lwIP-based cores hostnames are resolved with the non-blocking
+// dns_gethostbyname(); elsewhere supply a resolver() or the UDP stack will
+// look the name up on every request
+#if (defined(ESP32) || defined(ESP8266) || defined(ARDUINO_ARCH_RP2040)) && !defined(NTP2_NO_LWIP_DNS)
+#define NTP2_LWIP_DNS
+#endif
+
+// lwIP raw-API transport for the NTP2() constructor: no Arduino UDP
+// object, replies timestamped in the receive callback. Opt in with
+// -DNTP2_LWIP_UDP on lwIP cores.
+#if defined(NTP2_LWIP_UDP) && !defined(NTP2_LWIP_DNS)
+#error "NTP2_LWIP_UDP needs an lwIP core (ESP32, ESP8266, RP2040) with NTP2_LWIP_DNS"
+#endif
+
+// Background sync task (beginTask()) on FreeRTOS cores: default stack
+// (bytes) and priority
+#if (defined(ESP32) || (defined(ARDUINO_ARCH_RP2040) && defined(__FREERTOS))) && !defined(NTP2_NO_TASK)
+#define NTP2_TASK
+#endif
+#define NTP_TASK_STACK     4096
+#define NTP_TASK_PRIORITY  1
+
+// Software PPS on a GPIO (pps()), driven by a hardware-backed esp_timer on
+// ESP32: default pulse width (ms)
+#if defined(ESP32) && !defined(NTP2_NO_PPS)
+#define NTP2_PPS
+#endif
+#define NTP_PPS_WIDTH      100
+
+// Server mode (serve()): minimum gap between one client's requests (ms),
+// clients tracked for rate limiting, and packets handled per update()
+#define NTP_SERVE_MIN_GAP  1000
+#ifndef NTP_SERVE_CLIENTS
+#if defined(__AVR__)
+#define NTP_SERVE_CLIENTS  4
+#else
+#define NTP_SERVE_CLIENTS  16
+#endif
+#endif
+#define NTP_SERVE_BATCH    16
+
+// Clients that can share one socket through an NTP2Dispatcher, and the
+// range its ephemeral local port is picked from
+#define NTP_DISPATCH_CLIENTS 4
+#define NTP_EPHEMERAL_MIN    49152
+#define NTP_EPHEMERAL_COUNT  16384
+
+// Listen-only mode (listen()): one-way path delay assumed for broadcasts
+// until a calibration exchange has measured it (us; RFC 5905 uses 4 ms)
+#define NTP_BCAST_DELAY    4000
+
+// Adaptive polling: corrections within NTP_POLL_GATE jitters plus
+// NTP_POLL_TOLERANCE ms count as stable; that many stable polls in a row
+// double the interval
+#define NTP_POLL_GATE       4
+#define NTP_POLL_TOLERANCE  10
+#define NTP_POLL_HYSTERESIS 3
+
+// Frequency (drift) estimation: shortest span between corrections used for
+// an estimate (ms), and the largest frequency error believed (parts per
+// billion; 500 ppm)
+#define NTP_FREQ_MIN_SPAN  900000
+#define NTP_FREQ_MAX       500000
+
+// Clock filter stages kept per server (RFC 5905 uses 8)
+#ifndef NTP_FILTER_SIZE
+#if defined(__AVR__)
+#define NTP_FILTER_SIZE    4
+#else
+#define NTP_FILTER_SIZE    8
+#endif
+#endif
+
+// Servers that can be registered with addServer(); all of them are queried
+// together each poll and the best one is used
+#ifndef NTP_MAX_SERVERS
+#if defined(__AVR__)
+#define NTP_MAX_SERVERS    2
+#else
+#define NTP_MAX_SERVERS    4
+#endif
+#endif
+
+// Runtime statistics (stats()): on by default except on AVR, where RAM is
+// tight. Define NTP2_STATS or NTP2_NO_STATS to choose, and
+// NTP2_STATS_HISTOGRAM to add an RTT histogram of NTP_STATS_HIST_BINS
+// power-of-two millisecond bins.
+#if !defined(NTP2_NO_STATS) && !defined(NTP2_STATS) && !defined(__AVR__)
+#define NTP2_STATS
+#endif
+#define NTP_STATS_HIST_BINS 12
+
+#if NTP_MAX_SERVERS < 1 || NTP_FILTER_SIZE < 1
+#error "NTP_MAX_SERVERS and NTP_FILTER_SIZE must be at least 1"
+#endif
+
 enum NTPStatus : uint8_t {
   NTP_BAD_PACKET   = 0x00,
   NTP_IDLE         = 0x01,
@@ -43,69 +227,614 @@ enum NTPStatus : uint8_t {
   NTP_UNKNOWN_KOD  = 0x20
 };
 
+// What the receive path makes of a packet, from NTP2::classify(). The
+// rejections match the Stats counters.
+enum NTPVerdict : uint8_t {
+  NTP_PKT_ACCEPT      = 0x00,  // server reply or broadcast usable as a sample
+  NTP_PKT_REQUEST     = 0x01,  // client request (answered in server mode)
+  NTP_PKT_KOD         = 0x02,  // Kiss-o'-Death
+  NTP_PKT_UNDERSIZED  = 0x03,  // shorter than an NTP header
+  NTP_PKT_BAD_TIME    = 0x04,  // zero Transmit Timestamp
+  NTP_PKT_BAD_LEAP    = 0x05,  // leap indicator 3 (unsynchronized)
+  NTP_PKT_BAD_VERSION = 0x06,
+  NTP_PKT_BAD_MODE    = 0x07,
+  NTP_PKT_BAD_STRATUM = 0x08
+};
+
+// Synchronous resolver hook, e.g. a wrapper around WiFi.hostByName().
+// Return true and fill ip on success.
+typedef bool (*NTPResolver)(const char* host, IPAddress& ip);
+
+class NTP2Dispatcher;
+
+// Broken-down time from utc() and local()
+struct NTPDateTime {
+  uint16_t year;             // e.g. 2025
+  uint8_t month;             // 1-12
+  uint8_t day;               // 1-31
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+  uint8_t weekday;           // 0 Sunday - 6 Saturday
+  uint16_t millis;
+};
+
+// Daylight saving for local(): minutes to add at that UTC time (0 when
+// standard time applies)
+typedef int16_t (*NTPDstRule)(time_t utc);
+
+// Called from update() as each UTC second begins, with that second
+typedef void (*NTPSecondHandler)(time_t epoch);
+
+// Called when the clock steps instead of slewing, with the step in ms
+typedef void (*NTPStepHandler)(int32_t stepMs);
+
+#ifdef NTP2_LWIP_UDP
+struct udp_pcb;
+struct pbuf;
+#endif
+
+// Warm-start persistence (persist()). The save hook gets a blob of
+// NTP_STATE_SIZE bytes after a sync; the load hook fills one at begin()
+// and sets elapsedMs to the time since it was saved (0 if unknown). After
+// the first sync, saves are limited to one per NTP_STATE_SAVE_MIN (ms)
+// unless the server, poll interval or frequency validity changes, or the
+// frequency moves by NTP_STATE_SAVE_PPB, so flash isn't worn per sync.
+#define NTP_STATE_SIZE     26
+#define NTP_STATE_SAVE_MIN 3600000UL
+#define NTP_STATE_SAVE_PPB 1000
+#define NTP_STATE_MAGIC    0x4E
+#define NTP_STATE_VERSION  1
+typedef void (*NTPStateSave)(const uint8_t* blob, size_t len);
+typedef bool (*NTPStateLoad)(uint8_t* blob, size_t len, uint32_t& elapsedMs);
+
 class NTP2 {
   public:
+#ifdef NTP2_STATS
+    // Counters since begin() or resetStats(). Times are in us.
+    struct Stats {
+      uint32_t requests;         // requests sent
+      uint32_t replies;          // replies accepted as samples
+      uint32_t stale;            // late or duplicate replies to our requests
+      uint32_t undersized;       // packets shorter than an NTP header
+      uint32_t mismatched;       // Originate Timestamp matches no request
+      uint32_t served;           // server mode: replies sent
+      uint32_t rateLimited;      // server mode: requests over the rate limit
+      uint32_t broadcasts;       // listen mode: broadcasts taken as samples
+      // checkValid() rejections by reason
+      uint32_t badTime;          // zero Transmit, or Receive/Transmit inconsistent
+      uint32_t badLeap;          // leap indicator 3 (unsynchronized)
+      uint32_t badVersion;
+      uint32_t badMode;
+      uint32_t badStratum;
+#ifndef NTP2_NO_KOD
+      uint16_t kod[NTP_UNKNOWN_KOD - NTP_KOD_RATE + 1]; // by code - NTP_KOD_RATE
+#endif
+      uint32_t rttMin = 0xFFFFFFFF;
+      uint32_t rttAvg;
+      uint32_t rttMax;
+      int32_t lastOffset;        // selected server's filtered offset
+      uint32_t lastJitter;
+#ifdef NTP2_STATS_HISTOGRAM
+      uint16_t rttHist[NTP_STATS_HIST_BINS]; // bin i: RTT below 2^i ms
+#endif
+    };
+#endif
+
     NTP2(UDP& udp);
+#ifdef NTP2_LWIP_UDP
+    NTP2();
+#endif
     ~NTP2();
 
     void begin();
     void begin(const char* server);
     void begin(IPAddress serverIP);
     void stop();
+#ifdef NTP2_TASK
+    bool beginTask(uint32_t stackSize = NTP_TASK_STACK, uint8_t priority = NTP_TASK_PRIORITY, int8_t core = -1);
+    void stopTask();
+#endif
+
+    bool addServer(const char* server);
+    bool addServer(IPAddress serverIP);
+    void clearServers();
+    uint8_t serverCount();
 
     void updateInterval(unsigned long uInterval);
     void responseDelay(uint32_t newDelay);
     void retryDelay(uint32_t newDelay);
+    void adaptivePoll(uint32_t minInterval, uint32_t maxInterval);
+    uint32_t pollInterval();
+    void dnsTTL(uint32_t ttl);
+    void resolver(NTPResolver fn);
+    void iburst(bool enable, uint32_t goodDelay = NTP_BURST_GOOD_DELAY);
+    void pollJitter(uint8_t percent = NTP_POLL_JITTER, uint32_t startupMax = NTP_STARTUP_JITTER, uint32_t seed = 0);
+    void failover(bool enable);
+#ifndef NTP2_NO_SLEW
+    void slew(bool enable, uint32_t threshold = NTP_SLEW_THRESHOLD, uint32_t window = NTP_SLEW_WINDOW,
+              NTPStepHandler onStep = nullptr);
+#endif
+#ifndef NTP2_NO_SERVE
+    void serve(bool enable, uint32_t minGap = NTP_SERVE_MIN_GAP, bool sendKod = true);
+#endif
+#ifndef NTP2_NO_LISTEN
+    void listen(bool enable, IPAddress group = IPAddress(0, 0, 0, 0), bool calibrate = true);
+#endif
+    void persist(NTPStateSave save, NTPStateLoad load, uint32_t minInterval = NTP_STATE_SAVE_MIN);
+    size_t saveState(uint8_t* blob, size_t len);
+    bool restoreState(const uint8_t* blob, size_t len, uint32_t elapsedMs = 0);
 
     NTPStatus update();
-    NTPStatus forceUpdate();
+    NTPStatus forceUpdate(bool burst = false);
+    NTPStatus syncOnce();
+    uint32_t nextWakeMillis();
+    uint32_t millisToNextSecond();
+    uint32_t microsToNextSecond();
+    void onSecond(NTPSecondHandler fn);
+#ifdef NTP2_PPS
+    bool pps(int8_t pin, uint16_t widthMs = NTP_PPS_WIDTH);
+#endif
 
     time_t epoch();
+#ifndef NTP2_NO_CALENDAR
+    // Unlike the other getters these write a day cache (and local() calls
+    // the DST rule): one task or core each, never from an ISR
+    bool utc(NTPDateTime& t);
+    bool local(NTPDateTime& t);
+    void timeZone(int16_t offsetMinutes, NTPDstRule dst = nullptr);
+#endif
+    uint64_t epochMillis();
+    uint64_t epochMicros();
+    uint64_t ntpTime();
     uint32_t timestamp();
+    int32_t offset();
+    uint32_t roundTripDelay();
+    uint32_t jitter();
+    int32_t frequency();
+    int8_t syncServer();
+    uint16_t serverScore(uint8_t index);
+#ifndef NTP2_NO_KOD
+    uint16_t kodCount(NTPStatus code);
+    uint16_t serverKodCount(uint8_t index);
+    NTPStatus serverKod(uint8_t index);
+    void resetKodCounts();
+#endif
+#ifdef NTP2_STATS
+    Stats stats();
+    void resetStats();
+#endif
     bool ntpStat();
+    static NTPVerdict classify(const uint8_t* buf, size_t len, NTPStatus* kod = nullptr);
 
   private:
-    void init();
-    bool checkValid(uint32_t tempTimeSeconds);
+    // One clock filter stage, 16 bytes. Offsets are relative to our clock
+    // and re-based whenever it is corrected.
+    struct Sample {
+      int32_t offset;            // us
+      uint32_t delay;            // us
+      uint32_t disp;             // us, at arrival
+      uint32_t rxMillis;         // arrival, for aging
+    };
+
+    struct Peer {
+      const char* host;          // nullptr when addressed by IP
+      IPAddress ip;
+      // T1 of the request in flight (32.32), also the token the server
+      // copies back into the Originate Timestamp
+      uint32_t reqLocalMicros;
+      uint64_t reqTx;
+      // Sample from this cycle's reply, us
+      uint32_t rxMillis;
+      int64_t offset;
+      uint32_t delay;
+      uint32_t disp;
+      NTPStatus status;
+      bool pending;              // request out, no answer yet
+      uint32_t sentAddr;         // where it went, 0 if sent by name
+      bool fresh;                // sample accepted this cycle
+      // Clock filter and its output, us
+      Sample filter[NTP_FILTER_SIZE];
+      uint8_t filterHead;
+      uint8_t filterCount;
+      int32_t fOffset;
+      uint32_t fDelay;
+      uint32_t fDisp;
+      uint32_t fJitter;
+      uint32_t fRxMillis;
+      uint32_t usedRxMillis;     // filter sample the clock was last set from
+      // Upstream quality, passed on by server mode
+      uint8_t leap;
+      uint8_t stratum;
+      uint32_t rootDelay;        // 16.16 s
+      uint32_t rootDisp;         // 16.16 s
+      // DNS cache for hostname servers (ip holds the resolved address)
+      uint32_t resolvedMillis;
+      volatile uint32_t dnsResult; // written by the lwIP callback
+      uint8_t dnsState;
+      uint8_t failCount;         // consecutive polls without a good reply
+      uint8_t reach;             // one bit per poll, newest in bit 0
+      bool polled;               // queried this cycle
+      bool tried;                // failover: already queried this round
+      uint8_t idlePolls;         // failover: polls sat out since the last miss was aged
+#ifndef NTP2_NO_LISTEN
+      bool learned;              // added by a broadcast, slot reclaimable
+#endif
+      bool demoted;              // left out of polls until demotedUntil
+      uint32_t demotedUntil;
+#ifndef NTP2_NO_KOD
+      uint16_t kodCount;         // KoDs received from this server
+      NTPStatus lastKod;         // most recent one, NTP_IDLE if none
+#endif
+      bool awaitingDns;          // poll started, request not sent yet
+    };
+
+    // The response fields we use, decoded as they are read
+    struct Packet {
+      uint8_t flags;             // LI, VN, Mode
+      uint8_t stratum;
+      uint8_t poll;
+      uint32_t rootDelay;        // 16.16 s
+      uint32_t rootDisp;         // 16.16 s
+      uint32_t refId;            // KoD code when stratum is 0
+      uint64_t org;              // Originate: our token
+      uint64_t rx;               // T2
+      uint64_t tx;               // T3
+    };
+
+    // Published clock state, everything the time getters read. update()
+    // is the only writer; readers on other cores or in ISRs never block.
+    struct Snapshot {
+      uint64_t ntp;              // 32.32 NTP time at the anchor
+      uint32_t micros;           // micros() at the anchor
+      uint32_t millis;           // millis() at the anchor
+      int32_t freqPpb;
+#ifndef NTP2_NO_SLEW
+      int32_t slewLeft;          // us still to be slewed in after the anchor
+      uint32_t slewSpan;         // us it is spread over
+#endif
+      uint32_t epochSec;         // Unix second at the anchor, 0: no valid time
+      uint32_t epochSecMillis;   // millis() at which epochSec began
+    };
+
+    enum : uint8_t { DNS_IDLE, DNS_LOOKUP, DNS_CACHED };
+    enum : int8_t {
+      NTP_DNS_FAILED = -2,       // lookup failed, skip this server
+      NTP_DNS_UNCACHED = -1,     // no resolver, send by hostname
+      NTP_DNS_PENDING = 0,       // lookup in progress
+      NTP_DNS_READY = 1          // ip is valid
+    };
+
+    void start();
+    void init(Peer& peer, uint8_t index);
+    bool transmit(Peer& p, uint8_t index, bool byIP);
+    int8_t resolveHost(Peer& p);
+    bool checkValid(const Packet& pkt, uint32_t tempTimeSeconds);
+    static NTPVerdict verdict(const Packet& pkt, uint32_t tempTimeSeconds);
     NTPStatus badRead();
     NTPStatus sendNTPRequest();
     NTPStatus processNTPResponse();
+    NTPStatus receivePackets();
+#ifndef NTP2_NO_SERVE
+    void serveRequest(const Packet& req, uint32_t rxMicros, IPAddress ip, uint16_t port);
+#endif
+    NTPStatus handlePacket(const Packet& pkt, uint32_t rxMicros, uint32_t rxMillis, IPAddress ip, uint16_t port);
+    uint8_t claim(const Packet& pkt, IPAddress ip);
+    void readPacket(Packet& pkt);
+    uint32_t read32();
+    uint64_t read64();
+    static void unpack(const uint8_t* hdr, Packet& pkt);
+    void decodeResponse(const Packet& pkt, uint32_t rxMicros, uint32_t rxMillis, IPAddress ip);
+#ifndef NTP2_NO_LISTEN
+    NTPStatus decodeBroadcast(const Packet& pkt, uint32_t rxMicros, uint32_t rxMillis, IPAddress ip);
+    int8_t learnPeer(IPAddress ip);
+#endif
+#ifdef NTP2_LWIP_UDP
+    void rawRecv(struct pbuf* p, uint32_t ip, uint16_t port);
+    bool rawSend(const uint8_t* data, IPAddress ip, uint16_t port);
+#endif
+    NTPStatus finishCycle();
+    void endCycle();
+    void stepClock(int64_t correction);
+    int32_t estimateFrequency(int32_t correction, uint64_t sampleMillis);
+    void adaptInterval(int32_t correction, uint32_t jitter);
+    uint32_t backoff();
+    uint32_t dueInterval();
+    uint32_t randomBelow(uint32_t n);
+    int64_t driftMicros(uint64_t elapsedUs);
+    static int64_t slewPart(int32_t total, uint32_t span, uint64_t elapsedUs);
+    int64_t slewPending(uint64_t nowMicros);
+    void publishSnapshot(bool step = false);
+    void writeSnapshot(const Snapshot& next);
+    void readSnapshot(Snapshot& out);
+    void readSeconds(uint32_t& sec, uint32_t& secMillis);
+    void addSample(Peer& p);
+    void clockFilter(Peer& p, uint32_t now);
+    static uint32_t distance(const Peer& p);
+    static int32_t clamp32(int64_t v);
+    static uint32_t isqrt(uint64_t v);
+    void startBurst();
+    uint32_t pollWakeMillis();
+    void fireSecond();
+#ifndef NTP2_NO_CALENDAR
+    // Calendar fields of the day beginning at start (Unix seconds)
+    struct DayCache {
+      uint32_t start;            // 0: nothing cached
+      uint16_t year;
+      uint8_t month;
+      uint8_t day;
+      uint8_t weekday;
+    };
+    bool nowSeconds(uint32_t& sec, uint16_t& ms);
+    static void breakDown(uint32_t sec, uint16_t ms, DayCache& cache, NTPDateTime& t);
+#endif
+#ifdef NTP2_PPS
+    static void ppsTick(void* arg);
+#endif
+    int8_t selectPeer();
+    uint16_t score(Peer& p, uint32_t now);
+    int8_t rankedPeer(uint32_t now);
+    uint64_t localNtpTime(uint64_t nowMicros);
+    uint64_t monoMillis();
+    uint64_t monoMicros();
+    static int64_t microsToNtp(int64_t us);
+    static int64_t ntpToMicros(int64_t ntp);
+    static uint32_t be32(const uint8_t *p);
+    static void put32(uint8_t* p, uint32_t v);
+    static uint16_t fletcher16(const uint8_t* p, size_t len);
+    void autoSave();
+#ifdef NTP2_TASK
+    static void taskEntry(void* arg);
+    void taskLoop();
+    uint32_t taskWait();
+    bool inTask();
+#endif
 
     UDP *udp;
-    const char* server = nullptr;
-    IPAddress serverIP;
-
-    uint8_t ntpRequest[NTP_PACKET_SIZE];
-    uint8_t ntpQuery[NTP_PACKET_SIZE];
+    // Set by NTP2Dispatcher::attach(): the socket is shared and packets are
+    // handed to us by the dispatcher. Our own socket is kept for detach().
+    NTP2Dispatcher* dispatcher = nullptr;
+    UDP *ownUdp = nullptr;
+    friend class NTP2Dispatcher;
+#ifdef NTP2_LWIP_UDP
+    // Raw backend (udp == nullptr): our pcb, and replies handed over from
+    // the lwIP thread, one slot per server plus a spare for strays
+    struct RxSlot {
+      Packet pkt;
+      uint32_t rxMicros;
+      uint32_t rxMillis;
+      uint32_t ip;               // sender, for server mode
+      uint16_t port;
+      volatile bool full;
+    };
+    struct udp_pcb* pcb = nullptr;
+    RxSlot rxSlots[NTP_MAX_SERVERS + 1] = {};
+#endif
+    Peer peers[NTP_MAX_SERVERS];
+    uint8_t peerCount = 0;
+    uint8_t pendingCount = 0;
+    int8_t syncPeer = -1;
 
     uint32_t defaultInterval = NTP_POLL_INTERVAL;
     uint32_t activeInterval = defaultInterval;
     uint32_t responseDelayValue = NTP_RESPONSE_DELAY;
     uint32_t retryDelayValue = NTP_RETRY_DELAY;
-    uint32_t lastUpdate = 0;
-    uint32_t requestTimestamp = 0;
-    // Request token (copied back by server into Originate Timestamp)
-    uint32_t reqTxSec = 0;
-    uint32_t reqTxFrac = 0;
+    // Adaptive polling bounds (0: fixed interval) and state
+    uint32_t pollMin = 0;
+    uint32_t pollMax = 0;
+    uint8_t pollCounter = 0;
+    uint8_t failStreak = 0;
+    // Fleet jitter: spread (percent, 0: off), startup window, the skew
+    // rolled for the interval in progress (per mille), and a xorshift32
+    // state
+    uint8_t jitterPct = 0;
+    uint32_t startupJitter = 0;
+    int16_t pollSkew = 0;
+    uint32_t rngState = 0;
+    // Failover: poll only the best-ranked server, moving down the ranking
+    // within the cycle while they fail
+    bool failoverMode = false;
+    uint32_t dnsTTLValue = NTP_DNS_TTL;
+    NTPResolver resolverFn = nullptr;
+    // 64-bit monotonic millis (see monoMillis())
+    uint32_t monoLow = 0;
+    uint32_t monoHigh = 0;
+    // 64-bit monotonic micros (see monoMicros())
+    uint64_t microsLast = 0;
+    uint64_t microsLastMs = 0;
+    uint64_t lastUpdate = 0;
+    uint64_t requestTimestamp = 0;
+    int32_t offsetMs = 0;
+    uint32_t delayMs = 0;
     uint32_t lastResponseMillis = 0;
-    uint32_t lastSyncMillis = 0;
+    uint64_t lastSyncMicros = 0;
     uint32_t ntpTimeSeconds = 0;
-    uint64_t ntpMillisAtSync = 0;
+    uint64_t ntpAtSync = 0;            // 32.32 NTP time at lastSyncMicros
+    // Oscillator frequency error, applied between syncs
+    int32_t freqPpb = 0;
+    bool freqValid = false;
+    uint64_t freqAnchorMillis = 0;     // monoMillis()
+    int32_t freqAccum = 0;             // corrections (us) since freqAnchorMillis
+    // Slewing: threshold (us, 0: always step) and window (ms), and the
+    // correction being worked off since lastSyncMicros
+#ifndef NTP2_NO_SLEW
+    uint32_t slewThreshold = 0;
+    uint32_t slewWindow = NTP_SLEW_WINDOW;
+    NTPStepHandler stepFn = nullptr;
+    int32_t slewTotal = 0;             // us
+    uint32_t slewSpan = 0;             // us
+#else
+    static constexpr uint32_t slewThreshold = 0;
+    static constexpr int32_t slewTotal = 0;
+    static constexpr uint32_t slewSpan = 0;
+#endif
+    // Seqlock over two snapshot copies (see writeSnapshot()); AVR, with
+    // one core, keeps a single copy written with interrupts masked
+#if defined(__AVR__)
+    Snapshot snap[1] = {};
+#else
+    volatile uint8_t snapSeq = 0;
+    Snapshot snap[2] = {};
+#endif
 
     bool force = false;
+    bool provisional = false;          // clock restored, not yet confirmed
+    // Second-boundary callback, and the second it last ran for
+    NTPSecondHandler secondFn = nullptr;
+    time_t secondFired = 0;
+    // Calendar caches for utc() and local(), and the local time rule; the
+    // DST offset is kept until the next whole UTC hour
+#ifndef NTP2_NO_CALENDAR
+    DayCache utcDay = {};
+    DayCache localDay = {};
+    int16_t tzOffset = 0;              // minutes
+    NTPDstRule dstFn = nullptr;
+    int16_t dstMinutes = 0;
+    uint32_t dstUntil = 0;
+#endif
+#ifdef NTP2_PPS
+    // PPS output: esp_timer handle, pin (-1 off), width, and the pin level
+    void* ppsTimer = nullptr;
+    int8_t ppsPin = -1;
+    uint16_t ppsWidth = NTP_PPS_WIDTH;
+    volatile bool ppsHigh = false;
+#endif
+    // Server mode and its per-client rate limiting
+#ifndef NTP2_NO_SERVE
+    struct Client {
+      uint32_t ip;
+      uint32_t lastMillis;
+      uint8_t strikes;           // requests in a row over the limit
+    };
+    bool serving = false;
+    bool serveKod = true;
+    uint32_t serveMinGap = NTP_SERVE_MIN_GAP;
+    Client clients[NTP_SERVE_CLIENTS] = {};
+#else
+    static constexpr bool serving = false;
+#endif
+    // Listen-only mode: multicast group (0: broadcast only), and the
+    // one-way delay added to each broadcast, measured once if calibrating
+#ifndef NTP2_NO_LISTEN
+    bool listening = false;
+    bool calibrating = false;
+    uint32_t listenGroup = 0;
+    uint32_t bcastDelayUs = NTP_BCAST_DELAY;
+#else
+    static constexpr bool listening = false;
+    static constexpr bool calibrating = false;
+    static constexpr uint32_t listenGroup = 0;
+#endif
+    NTPStateSave stateSaveFn = nullptr;
+    NTPStateLoad stateLoadFn = nullptr;
+    uint32_t saveMinInterval = NTP_STATE_SAVE_MIN;
+    uint32_t savedAtMillis = 0;
+    uint32_t savedInterval = 0;
+    int32_t savedFreqPpb = 0;
+    int8_t savedPeer = -1;
+    bool savedFreqValid = false;
+    bool savedOnce = false;
+    bool iburstEnabled = false;
+    uint8_t burstLeft = 0;
+    uint32_t burstGoodDelay = NTP_BURST_GOOD_DELAY;
+    bool burstSynced = false;
     NTPStatus ntpSt = NTP_BAD_PACKET;
+#ifdef NTP2_TASK
+    // Background task handle, and requests posted to it from other tasks
+    void* taskHandle = nullptr;
+    volatile bool taskStop = false;
+    volatile uint8_t taskRequest = 0;
+#endif
 
-    struct KodEntry {
-      const char *code;
-      uint8_t ret;
-    };
+#ifdef NTP2_STATS
+    Stats st = Stats();
+    uint64_t rttSum = 0;
+#endif
 
-    inline static const KodEntry kodLookup[15] = {
-      {"RATE", 0x10}, {"DENY", 0x11}, {"ACST", 0x12}, {"AUTH", 0x13},
-      {"AUTO", 0x14}, {"BCST", 0x15}, {"CRYP", 0x16}, {"DROP", 0x17},
-      {"RSTR", 0x18}, {"INIT", 0x19}, {"MCST", 0x1A}, {"NKEY", 0x1B},
-      {"NTSN", 0x1C}, {"RMOT", 0x1D}, {"STEP", 0x1E}
-    };
+#ifndef NTP2_NO_KOD
+    // KoDs received, indexed by code - NTP_KOD_RATE (0x1F is unused)
+    uint16_t kodCounts[NTP_UNKNOWN_KOD - NTP_KOD_RATE + 1] = {};
+#endif
+
+    // A KoD code packed the way it arrives in the reference ID
+    static constexpr uint32_t kodCode(const char (&c)[5]) {
+      return ((uint32_t)(uint8_t)c[0] << 24) | ((uint32_t)(uint8_t)c[1] << 16) |
+             ((uint32_t)(uint8_t)c[2] << 8) | (uint32_t)(uint8_t)c[3];
+    }
+#ifndef NTP2_NO_KOD
+    static NTPStatus classifyKod(uint32_t refId);
+#endif
+};
+
+// The features this build has, for static_assert() or if constexpr
+struct NTP2Features {
+  static constexpr uint8_t servers = NTP_MAX_SERVERS;
+  static constexpr uint8_t filterStages = NTP_FILTER_SIZE;
+#ifdef NTP2_STATS
+  static constexpr bool stats = true;
+#else
+  static constexpr bool stats = false;
+#endif
+#ifdef NTP2_NO_KOD
+  static constexpr bool kod = false;
+#else
+  static constexpr bool kod = true;
+#endif
+#ifdef NTP2_NO_SERVE
+  static constexpr bool serve = false;
+#else
+  static constexpr bool serve = true;
+#endif
+#ifdef NTP2_NO_SLEW
+  static constexpr bool slew = false;
+#else
+  static constexpr bool slew = true;
+#endif
+#ifdef NTP2_NO_LISTEN
+  static constexpr bool listen = false;
+#else
+  static constexpr bool listen = true;
+#endif
+#ifdef NTP2_NO_CALENDAR
+  static constexpr bool calendar = false;
+#else
+  static constexpr bool calendar = true;
+#endif
+#ifdef NTP2_TASK
+  static constexpr bool task = true;
+#else
+  static constexpr bool task = false;
+#endif
+#ifdef NTP2_LWIP_UDP
+  static constexpr bool lwipUdp = true;
+#else
+  static constexpr bool lwipUdp = false;
+#endif
+};
+
+// Lets several NTP2 clients, and other protocols, share one UDP socket on
+// an ephemeral port. update() hands NTP packets (from port 123, or
+// anything if bound to it) to the client whose request they answer;
+// anything else is left unread for the caller.
+class NTP2Dispatcher {
+  public:
+    NTP2Dispatcher(UDP& udp);
+    ~NTP2Dispatcher();
+
+    uint16_t begin(uint16_t localPort = 0);
+    void stop();
+    bool attach(NTP2& client);
+    void detach(NTP2& client);
+    int update();
+    uint16_t localPort();
+
+  private:
+    NTP2* route(const NTP2::Packet& pkt, IPAddress ip);
+
+    UDP *udp;
+    NTP2* clients[NTP_DISPATCH_CLIENTS] = {};
+    uint8_t clientCount = 0;
+    uint16_t port = 0;
 };
 
 #endif